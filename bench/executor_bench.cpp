@@ -0,0 +1,163 @@
+/**
+ * executor_bench
+ *  xd::util::executor against the hand-rolled pool every service has: N
+ *  IceUtil::Thread workers sharing one mqueue of tasks.
+ *
+ *      executor_bench [workers] [tasks]
+ *
+ *  Prints one JSON object per line.
+ */
+#include <IceUtil/Thread.h>
+#include <IceUtil/Time.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+
+#include <xd/util/executor.h>
+#include <xd/util/mqueue.h>
+
+namespace {
+
+typedef std::function<void()> task_type;
+
+class naive_pool {
+  public:
+    explicit naive_pool(size_t workers) {
+        for (size_t i = 0; i < workers; i++) {
+            IceUtil::ThreadPtr w = new worker(&m_queue);
+            m_controls.push_back(w->start());
+            m_workers.push_back(w);
+        }
+    }
+    ~naive_pool() {
+        for (size_t i = 0; i < m_controls.size(); i++) {
+            m_queue.put(task_type());
+        }
+        for (size_t i = 0; i < m_controls.size(); i++) {
+            m_controls[i].join();
+        }
+    }
+    void post(const task_type& t) {
+        m_queue.put(t);
+    }
+
+  private:
+    class worker: public IceUtil::Thread {
+      public:
+        explicit worker(xd::util::mqueue<task_type>* queue): m_queue(queue) {
+        }
+        virtual void run(void) {
+            for (;;) {
+                task_type t = m_queue->get();
+                if (!t) {
+                    break;
+                }
+                t();
+            }
+        }
+
+      private:
+        xd::util::mqueue<task_type>* m_queue;
+    };
+
+    xd::util::mqueue<task_type> m_queue;
+    std::vector<IceUtil::ThreadPtr> m_workers;
+    std::vector<IceUtil::ThreadControl> m_controls;
+};
+
+struct countdown {
+    explicit countdown(long n): left(n) {
+    }
+    void done(void) {
+        if (__atomic_sub_fetch(&left, 1, __ATOMIC_ACQ_REL) == 0) {
+            all.notify_all();
+        }
+    }
+    void wait(void) {
+        while (__atomic_load_n(&left, __ATOMIC_ACQUIRE) > 0) {
+            int ticket = all.prepare_wait();
+            if (__atomic_load_n(&left, __ATOMIC_ACQUIRE) == 0) {
+                all.cancel_wait();
+                break;
+            }
+            all.wait(ticket, xd::util::wait_policy(), 0);
+        }
+    }
+    long left;
+    xd::util::waitqueue all;
+};
+
+// a few hundred ns of work so the queue is what is measured
+inline void spin_work(unsigned long seed) {
+    volatile unsigned long x = seed;
+    for (int i = 0; i < 64; i++) {
+        x = x * 6364136223846793005UL + 1442695040888963407UL;
+    }
+}
+
+void report(const char* bench, const char* pool, size_t workers, long tasks, const IceUtil::Time& elapsed) {
+    double secs = elapsed.toMicroSecondsDouble() / 1e6;
+    printf("{\"bench\": \"%s\", \"pool\": \"%s\", \"workers\": %lu, \"tasks\": %ld, "
+           "\"seconds\": %.6f, \"tasks_per_sec\": %.0f}\n",
+           bench, pool, static_cast<unsigned long>(workers), tasks, secs, tasks / secs);
+}
+
+// external producer posts every task
+template <typename Pool>
+IceUtil::Time flat(Pool& pool, long tasks) {
+    countdown latch(tasks);
+    IceUtil::Time start = IceUtil::Time::now(IceUtil::Time::Monotonic);
+    for (long i = 0; i < tasks; i++) {
+        pool.post([&latch, i] { spin_work(i); latch.done(); });
+    }
+    latch.wait();
+    return IceUtil::Time::now(IceUtil::Time::Monotonic) - start;
+}
+
+// each task fans out children from inside the pool, the work-stealing case
+template <typename Pool>
+void fan_out(Pool* pool, countdown* latch, int depth) {
+    spin_work(depth);
+    if (depth > 0) {
+        pool->post([pool, latch, depth] { fan_out(pool, latch, depth - 1); });
+        pool->post([pool, latch, depth] { fan_out(pool, latch, depth - 1); });
+    }
+    latch->done();
+}
+
+template <typename Pool>
+IceUtil::Time tree(Pool& pool, int depth) {
+    countdown latch((2L << depth) - 1);
+    IceUtil::Time start = IceUtil::Time::now(IceUtil::Time::Monotonic);
+    pool.post([&pool, &latch, depth] { fan_out(&pool, &latch, depth); });
+    latch.wait();
+    return IceUtil::Time::now(IceUtil::Time::Monotonic) - start;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    size_t workers = argc > 1 ? strtoul(argv[1], 0, 10) : 4;
+    long tasks = argc > 2 ? strtol(argv[2], 0, 10) : 1000000;
+    int depth = 0;
+    while ((2L << (depth + 1)) - 1 <= tasks) depth++;
+
+    {
+        naive_pool pool(workers);
+        report("flat", "naive_mqueue", workers, tasks, flat(pool, tasks));
+        report("tree", "naive_mqueue", workers, (2L << depth) - 1, tree(pool, depth));
+    }
+    {
+        xd::util::executor pool(workers);
+        report("flat", "executor", workers, tasks, flat(pool, tasks));
+        report("tree", "executor", workers, (2L << depth) - 1, tree(pool, depth));
+
+        std::vector<unsigned long> v(tasks);
+        IceUtil::Time start = IceUtil::Time::now(IceUtil::Time::Monotonic);
+        pool.parallel_for(0, v.size(), [&v](size_t i) { spin_work(i); v[i] = i; }, 256);
+        report("parallel_for", "executor", workers, tasks, IceUtil::Time::now(IceUtil::Time::Monotonic) - start);
+    }
+    return 0;
+}
@@ -0,0 +1,225 @@
+/**
+ * mqueue_bench
+ *  Throughput and hand-off latency of mqueue and its faster variants,
+ *  swept over producer/consumer counts, payload sizes, batch sizes and
+ *  capacities.
+ *
+ *      mqueue_bench [items] [queue]
+ *
+ *  items per run, 200000 by default; queue limits the sweep to one of
+ *  mqueue, mpmc_ring, spsc_ring, sharded_mqueue.  Prints one JSON object
+ *  per run and line, latency in ns from put to get:
+ *
+ *      {"bench": "mqueue", "queue": "mpmc_ring", "producers": 2, "consumers": 2,
+ *       "payload": 64, "batch": 32, "capacity": 4096, "items": 200000,
+ *       "seconds": ..., "ops_per_sec": ..., "p50_ns": ..., "p99_ns": ..., "p999_ns": ...}
+ */
+#include <IceUtil/Thread.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <xd/util/mpmc_ring.h>
+#include <xd/util/mqueue.h>
+#include <xd/util/sharded_mqueue.h>
+#include <xd/util/spsc_ring.h>
+
+namespace {
+
+typedef long long nsecs_type;
+
+inline nsecs_type now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct message {
+    message(): stamp(0) {
+    }
+    nsecs_type stamp;           // when put
+    std::string payload;
+};
+
+// what one run shares between its threads
+struct run_state {
+    run_state(long items_, size_t payload_, size_t batch_):
+      items(items_), payload(payload_), batch(batch_), consumed(0), end(0) {
+    }
+    const long items;
+    const size_t payload;
+    const size_t batch;
+    long consumed;
+    nsecs_type end;             // when the last item was gotten
+};
+
+template <typename Queue>
+class producer: public IceUtil::Thread {
+  public:
+    producer(Queue* queue, run_state* state, long items):
+      m_queue(queue), m_state(state), m_items(items) {
+    }
+    virtual void run(void) {
+        std::vector<message> batch(m_state->batch);
+        for (size_t i = 0; i < batch.size(); i++) {
+            batch[i].payload.assign(m_state->payload, 'x');
+        }
+        for (long left = m_items; left > 0;) {
+            size_t n = std::min(static_cast<long>(batch.size()), left);
+            nsecs_type stamp = now_ns();
+            for (size_t i = 0; i < n; i++) {
+                batch[i].stamp = stamp;
+            }
+            if (n == 1) {
+                m_queue->put(batch[0]);
+            }
+            else {
+                m_queue->put(batch.begin(), batch.begin() + n);
+            }
+            left -= n;
+        }
+    }
+
+  private:
+    Queue* m_queue;
+    run_state* m_state;
+    long m_items;
+};
+
+template <typename Queue>
+class consumer: public IceUtil::Thread {
+  public:
+    consumer(Queue* queue, run_state* state): m_queue(queue), m_state(state) {
+        m_latencies.reserve(state->items);
+    }
+    virtual void run(void) {
+        std::vector<message> batch;
+        batch.reserve(m_state->batch);
+        while (__atomic_load_n(&m_state->consumed, __ATOMIC_ACQUIRE) < m_state->items) {
+            batch.clear();
+            size_t n = 0;
+            // short timeout: the others may have taken the last items
+            if (!m_queue->timed_get(10 * 1000, std::back_inserter(batch), m_state->batch, &n)) {
+                continue;
+            }
+            nsecs_type now = now_ns();
+            for (size_t i = 0; i < n; i++) {
+                m_latencies.push_back(now - batch[i].stamp);
+            }
+            if (__atomic_add_fetch(&m_state->consumed, static_cast<long>(n), __ATOMIC_ACQ_REL) ==
+                m_state->items) {
+                m_state->end = now;
+            }
+        }
+    }
+    const std::vector<nsecs_type>& latencies(void) const {
+        return m_latencies;
+    }
+
+  private:
+    Queue* m_queue;
+    run_state* m_state;
+    std::vector<nsecs_type> m_latencies;
+};
+
+nsecs_type percentile(std::vector<nsecs_type>* v, double p) {
+    if (v->empty()) {
+        return 0;
+    }
+    size_t k = static_cast<size_t>(p * (v->size() - 1));
+    std::nth_element(v->begin(), v->begin() + k, v->end());
+    return (*v)[k];
+}
+
+template <typename Queue>
+void run(const char* name, Queue* queue, size_t producers, size_t consumers,
+         size_t payload, size_t batch, size_t capacity, long items) {
+    run_state state(items, payload, batch);
+    std::vector<IceUtil::ThreadPtr> threads;
+    std::vector<consumer<Queue>*> readers;
+    std::vector<IceUtil::ThreadControl> controls;
+
+    for (size_t i = 0; i < consumers; i++) {
+        consumer<Queue>* c = new consumer<Queue>(queue, &state);
+        readers.push_back(c);
+        threads.push_back(c);
+        controls.push_back(c->start());
+    }
+    nsecs_type start = now_ns();
+    for (size_t i = 0; i < producers; i++) {
+        long share = items / producers + (i < items % producers ? 1 : 0);
+        IceUtil::ThreadPtr p = new producer<Queue>(queue, &state, share);
+        threads.push_back(p);
+        controls.push_back(p->start());
+    }
+    for (size_t i = 0; i < controls.size(); i++) {
+        controls[i].join();
+    }
+
+    std::vector<nsecs_type> latencies;
+    latencies.reserve(items);
+    for (size_t i = 0; i < readers.size(); i++) {
+        latencies.insert(latencies.end(), readers[i]->latencies().begin(), readers[i]->latencies().end());
+    }
+    double secs = (state.end - start) / 1e9;
+    printf("{\"bench\": \"mqueue\", \"queue\": \"%s\", \"producers\": %lu, \"consumers\": %lu, "
+           "\"payload\": %lu, \"batch\": %lu, \"capacity\": %lu, \"items\": %ld, "
+           "\"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+           "\"p50_ns\": %lld, \"p99_ns\": %lld, \"p999_ns\": %lld}\n",
+           name, static_cast<unsigned long>(producers), static_cast<unsigned long>(consumers),
+           static_cast<unsigned long>(payload), static_cast<unsigned long>(batch),
+           static_cast<unsigned long>(capacity), items, secs, items / secs,
+           percentile(&latencies, 0.50), percentile(&latencies, 0.99), percentile(&latencies, 0.999));
+    fflush(stdout);
+}
+
+bool selected(const char* only, const char* name) {
+    return only == 0 || strcmp(only, name) == 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    long items = argc > 1 ? strtol(argv[1], 0, 10) : 200000;
+    const char* only = argc > 2 ? argv[2] : 0;
+
+    const size_t threads[] = {1, 2, 4};
+    const size_t payloads[] = {8, 64, 1024};
+    const size_t batches[] = {1, 32};
+    const size_t capacities[] = {64, 4096};
+
+    for (size_t pi = 0; pi < sizeof(threads) / sizeof(threads[0]); pi++)
+    for (size_t ci = 0; ci < sizeof(threads) / sizeof(threads[0]); ci++)
+    for (size_t si = 0; si < sizeof(payloads) / sizeof(payloads[0]); si++)
+    for (size_t bi = 0; bi < sizeof(batches) / sizeof(batches[0]); bi++)
+    for (size_t vi = 0; vi < sizeof(capacities) / sizeof(capacities[0]); vi++) {
+        size_t p = threads[pi];
+        size_t c = threads[ci];
+        size_t payload = payloads[si];
+        size_t batch = batches[bi];
+        size_t capacity = capacities[vi];
+        if (selected(only, "mqueue")) {
+            xd::util::mqueue<message> q(capacity);
+            run("mqueue", &q, p, c, payload, batch, capacity, items);
+        }
+        if (selected(only, "mpmc_ring")) {
+            xd::util::mqueue<message, xd::util::mpmc_ring<message> > q(capacity);
+            run("mpmc_ring", &q, p, c, payload, batch, capacity, items);
+        }
+        if (selected(only, "spsc_ring") && p == 1 && c == 1) {
+            xd::util::mqueue<message, xd::util::spsc_ring<message> > q(capacity);
+            run("spsc_ring", &q, p, c, payload, batch, capacity, items);
+        }
+        if (selected(only, "sharded_mqueue")) {
+            xd::util::sharded_mqueue<message> q(std::max(p, c), capacity);
+            run("sharded_mqueue", &q, p, c, payload, batch, capacity, items);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * timeout_check
+ *  How close mqueue's timed_get and timed_put come to their deadline: each
+ *  is timed against an empty, or full, queue for several timeouts, and
+ *  must neither return before the timeout nor overshoot it by more than
+ *  the bound.
+ *
+ *      timeout_check [bound_usecs] [rounds]
+ *
+ *  bound_usecs is 2000 by default, rounds 20.  Prints one JSON object per
+ *  call and timeout, overshoot in usecs, and exits 1 if any is out of
+ *  bounds.
+ */
+#include <time.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <xd/util/mqueue.h>
+
+namespace {
+
+typedef long long usecs_type;
+
+inline usecs_type now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// the overshoot of each round, negative if it returned early
+template <typename Call>
+std::vector<usecs_type> measure(Call call, unsigned usecs, int rounds) {
+    std::vector<usecs_type> overshoots;
+    for (int i = 0; i < rounds; i++) {
+        usecs_type start = now_us();
+        bool done = call(usecs);
+        usecs_type elapsed = now_us() - start;
+        // a call that succeeded did not wait for its deadline
+        overshoots.push_back(done ? -usecs - 1 : elapsed - usecs);
+    }
+    return overshoots;
+}
+
+bool report(const char* name, unsigned usecs, std::vector<usecs_type> overshoots, usecs_type bound) {
+    std::sort(overshoots.begin(), overshoots.end());
+    usecs_type least = overshoots.front();
+    usecs_type most = overshoots.back();
+    bool ok = least >= 0 && most <= bound;
+    printf("{\"bench\": \"timeout\", \"call\": \"%s\", \"usecs\": %u, \"rounds\": %lu, "
+           "\"min_overshoot_us\": %lld, \"p50_overshoot_us\": %lld, \"max_overshoot_us\": %lld, "
+           "\"bound_us\": %lld, \"ok\": %s}\n",
+           name, usecs, static_cast<unsigned long>(overshoots.size()), least,
+           overshoots[overshoots.size() / 2], most, bound, ok ? "true" : "false");
+    fflush(stdout);
+    return ok;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    usecs_type bound = argc > 1 ? strtoll(argv[1], 0, 10) : 2000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+
+    xd::util::mqueue<int> empty(1);
+    xd::util::mqueue<int> full(1);
+    full.put(0);
+
+    const unsigned timeouts[] = {1000, 10000, 50000};
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); i++) {
+        unsigned usecs = timeouts[i];
+        ok = report("timed_get", usecs, measure([&empty](unsigned u) {
+            int item;
+            return empty.timed_get(u, &item);
+        }, usecs, rounds), bound) && ok;
+        ok = report("timed_put", usecs, measure([&full](unsigned u) {
+            return full.timed_put(u, 1);
+        }, usecs, rounds), bound) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -4,8 +4,10 @@ namespace xd { namespace util {
 
 const unsigned log::MAX_FILE_SIZE;
 const unsigned log::MAX_ITEM_LENGTH;
+const unsigned log::GUESS_ITEM_LENGTH;
 const unsigned log::CHANGE_FILE_NAME_INTERVAL;
 const unsigned log::MAX_CACHE_SIZE;
+const unsigned log::THREAD_BUFFER_SIZE;
 const char* const log::DEFAULT_TIME_STRING_FORMAT = "%Y-%m-%dT%H-%M-%S";
 const char log::DEFAULT_FIELD_SEPERATOR;
 const unsigned log::DEFAULT_FLUSH_INTERVAL;
@@ -83,6 +83,46 @@
 
 #endif   /* !HAVE_STRINGIZE */
 
+/**
+ * XD_HAVE_CXX11
+ *      Defined when rvalue references and variadic templates are usable,
+ *      the move/emplace members are built only then.
+ * XD_MOVE
+ *      std::move with XD_HAVE_CXX11, a plain copy otherwise.
+ */
+#if __cplusplus >= 201103L
+#   include <utility>
+#   define XD_HAVE_CXX11                1
+#   define XD_MOVE(x)                   std::move(x)
+#else
+#   define XD_MOVE(x)                   (x)
+#endif
+
+/**
+ * XD_HAVE_COROUTINES
+ *      Defined when C++20 coroutines are usable, the co_* awaitables of
+ *      mqueue and log are built only then.
+ */
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#   define XD_HAVE_COROUTINES           1
+#endif
+
+/**
+ * XD_CACHELINE_SIZE
+ *      Keep fields written by different threads on separate cache lines.
+ * XD_CPU_RELAX
+ *      Hint the cpu inside a spin-wait loop.
+ */
+#define XD_CACHELINE_SIZE               64
+
+#if defined(__i386__) || defined(__x86_64__)
+#   define XD_CPU_RELAX()               __asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__)
+#   define XD_CPU_RELAX()               __asm__ __volatile__("yield" ::: "memory")
+#else
+#   define XD_CPU_RELAX()               __asm__ __volatile__("" ::: "memory")
+#endif
+
 #define MAX(x, y)                       ((x) > (y) ? (x) : (y))
 #define MIN(x, y)                       ((x) < (y) ? (x) : (y))
 #define ABS(x)                          ((x) >= 0 ? (x) : -(x))
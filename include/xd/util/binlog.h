@@ -0,0 +1,413 @@
+#ifndef __XD_UTIL_BINLOG_H__
+#define __XD_UTIL_BINLOG_H__
+
+#include <stdint.h>
+
+#include <IceUtil/Mutex.h>
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <xd/topdef.h>
+
+#ifdef XD_HAVE_CXX11
+#   include <cstddef>
+#   include <type_traits>
+#endif
+
+namespace xd { namespace util {
+
+/**
+ * binlog_formats
+ *  Process-wide table of the format strings of deferred log calls, each
+ *  registered once per call site, see XD_LOG_DEFER in log.h.  Ids start
+ *  at 1 and never change, so a record needs only the id.  The entries
+ *  never move either: add() fills chunks of CHUNK_SIZE under a mutex and
+ *  publishes the count, and find() reads without a lock.
+ */
+class binlog_formats {
+  public:
+    static const unsigned CHUNK_SIZE = 256;
+    static const unsigned MAX_CHUNKS = 1024;
+
+    struct format {
+        std::string level;      // the level's name
+        std::string text;
+    };
+
+  public:
+    static unsigned add(const char* level, const char* text) {
+        IceUtil::Mutex::Lock lock(mutex());
+        unsigned n = __atomic_load_n(&count(), __ATOMIC_RELAXED);
+        if (n == CHUNK_SIZE * MAX_CHUNKS) {
+            throw std::length_error(_("too many deferred log formats"));
+        }
+        format*& chunk = chunks()[n / CHUNK_SIZE];
+        if (chunk == 0) {
+            chunk = new format[CHUNK_SIZE];
+        }
+        chunk[n % CHUNK_SIZE].level = level;
+        chunk[n % CHUNK_SIZE].text = text;
+        __atomic_store_n(&count(), n + 1, __ATOMIC_RELEASE);
+        return n + 1;
+    }
+    // the format registered as id, 0 if none
+    static const format* find(unsigned id) {
+        if (id == 0 || id > __atomic_load_n(&count(), __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        return &chunks()[(id - 1) / CHUNK_SIZE][(id - 1) % CHUNK_SIZE];
+    }
+
+  private:
+    static IceUtil::Mutex& mutex(void) {
+        static IceUtil::Mutex m;
+        return m;
+    }
+    static unsigned& count(void) {
+        static unsigned n = 0;
+        return n;
+    }
+    // kept to the end of the process, a reader may still hold an entry
+    static format** chunks(void) {
+        static format* c[MAX_CHUNKS] = {0};
+        return c;
+    }
+};
+
+/**
+ * binlog arguments
+ *  A deferred call stores each argument as a tag byte and its raw value:
+ *      'i' int64       every signed integer and char
+ *      'u' uint64      every unsigned integer and bool
+ *      'f' double      every floating point
+ *      's' uint32 length and the bytes, for C strings and std::string
+ *      'p' uint64      any other pointer, and nullptr
+ *  in host byte order, an enum as its underlying type; the decoder must run on a like machine.
+ */
+namespace internal {
+
+template <typename V>
+inline void binlog_append(std::string* out, char tag, V v) {
+    out->push_back(tag);
+    out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+inline void binlog_append_string(std::string* out, const char* s, size_t len) {
+    uint32_t n = static_cast<uint32_t>(len);
+    out->push_back('s');
+    out->append(reinterpret_cast<const char*>(&n), sizeof(n));
+    out->append(s, len);
+}
+
+}  // namespace internal
+
+#define BINLOG_ENCODE_SPECIFICATION(type, tag, wide)                    \
+    inline void binlog_encode(std::string* out, type v) {               \
+        internal::binlog_append(out, tag, static_cast<wide>(v));        \
+    }
+BINLOG_ENCODE_SPECIFICATION(char,               'i', int64_t);
+BINLOG_ENCODE_SPECIFICATION(signed char,        'i', int64_t);
+BINLOG_ENCODE_SPECIFICATION(short,              'i', int64_t);
+BINLOG_ENCODE_SPECIFICATION(int,                'i', int64_t);
+BINLOG_ENCODE_SPECIFICATION(long,               'i', int64_t);
+BINLOG_ENCODE_SPECIFICATION(long long,          'i', int64_t);
+BINLOG_ENCODE_SPECIFICATION(bool,               'u', uint64_t);
+BINLOG_ENCODE_SPECIFICATION(unsigned char,      'u', uint64_t);
+BINLOG_ENCODE_SPECIFICATION(unsigned short,     'u', uint64_t);
+BINLOG_ENCODE_SPECIFICATION(unsigned int,       'u', uint64_t);
+BINLOG_ENCODE_SPECIFICATION(unsigned long,      'u', uint64_t);
+BINLOG_ENCODE_SPECIFICATION(unsigned long long, 'u', uint64_t);
+BINLOG_ENCODE_SPECIFICATION(float,              'f', double);
+BINLOG_ENCODE_SPECIFICATION(double,             'f', double);
+BINLOG_ENCODE_SPECIFICATION(long double,        'f', double);
+#undef BINLOG_ENCODE_SPECIFICATION
+
+inline void binlog_encode(std::string* out, const char* s) {
+    if (s == 0) {
+        s = "(null)";
+    }
+    internal::binlog_append_string(out, s, strlen(s));
+}
+inline void binlog_encode(std::string* out, char* s) {
+    binlog_encode(out, static_cast<const char*>(s));
+}
+inline void binlog_encode(std::string* out, const std::string& s) {
+    internal::binlog_append_string(out, s.data(), s.size());
+}
+template <typename T>
+inline void binlog_encode(std::string* out, const T* p) {
+    internal::binlog_append(out, 'p', static_cast<uint64_t>(reinterpret_cast<uintptr_t>(p)));
+}
+
+#ifdef XD_HAVE_CXX11
+inline void binlog_encode(std::string* out, std::nullptr_t) {
+    internal::binlog_append(out, 'p', static_cast<uint64_t>(0));
+}
+template <typename T>
+inline typename std::enable_if<std::is_enum<T>::value>::type binlog_encode(std::string* out, T v) {
+    binlog_encode(out, static_cast<typename std::underlying_type<T>::type>(v));
+}
+
+inline void binlog_encode_all(std::string*) {
+}
+template <typename Arg, typename... Args>
+inline void binlog_encode_all(std::string* out, const Arg& arg, const Args&... args) {
+    binlog_encode(out, arg);
+    binlog_encode_all(out, args...);
+}
+#endif
+
+namespace internal {
+
+// the encoded arguments, read back in order
+class binlog_reader {
+  public:
+    binlog_reader(const char* data, size_t len): m_data(data), m_len(len), m_pos(0) {
+    }
+    bool more(void) const {
+        return m_pos < m_len;
+    }
+    char peek(void) const {
+        return m_data[m_pos];
+    }
+    template <typename V>
+    bool number(V* v) {
+        if (m_len - m_pos < 1 + sizeof(V)) {
+            return false;
+        }
+        memcpy(v, m_data + m_pos + 1, sizeof(V));
+        m_pos += 1 + sizeof(V);
+        return true;
+    }
+    bool string(const char** s, size_t* len) {
+        uint32_t n;
+        if (m_len - m_pos < 1 + sizeof(n)) {
+            return false;
+        }
+        memcpy(&n, m_data + m_pos + 1, sizeof(n));
+        if (m_len - m_pos - 1 - sizeof(n) < n) {
+            return false;
+        }
+        *s = m_data + m_pos + 1 + sizeof(n);
+        *len = n;
+        m_pos += 1 + sizeof(n) + n;
+        return true;
+    }
+
+  private:
+    const char* m_data;
+    size_t m_len;
+    size_t m_pos;
+};
+
+template <typename V>
+inline void binlog_appendf(std::string* out, const std::string& spec, V v) {
+    char buf[64];
+    int n = snprintf(buf, sizeof(buf), spec.c_str(), v);
+    if (n < 0) {
+        return;
+    }
+    if (static_cast<size_t>(n) < sizeof(buf)) {
+        out->append(buf, n);
+        return;
+    }
+    size_t at = out->size();
+    out->resize(at + n + 1);
+    snprintf(&(*out)[at], n + 1, spec.c_str(), v);
+    out->resize(at + n);
+}
+
+// width or precision, '*' taken from the next argument
+inline void binlog_spec_number(const std::string& format, size_t* i, binlog_reader* in,
+                               std::string* spec) {
+    if (*i < format.size() && format[*i] == '*') {
+        int64_t v = 0;
+        if (in->more() && (in->peek() == 'i' || in->peek() == 'u')) {
+            in->number(&v);
+        }
+        char buf[24];
+        snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(v));
+        *spec += buf;
+        ++*i;
+        return;
+    }
+    while (*i < format.size() && format[*i] >= '0' && format[*i] <= '9') {
+        *spec += format[(*i)++];
+    }
+}
+
+// one argument as its tag says, if the conversion does not fit it
+inline bool binlog_render_any(binlog_reader* in, std::string* out) {
+    int64_t i;
+    uint64_t u;
+    double f;
+    const char* s;
+    size_t len;
+    switch (in->peek()) {
+      case 'i':
+        if (!in->number(&i)) return false;
+        binlog_appendf(out, "%lld", static_cast<long long>(i));
+        return true;
+      case 'u':
+        if (!in->number(&u)) return false;
+        binlog_appendf(out, "%llu", static_cast<unsigned long long>(u));
+        return true;
+      case 'f':
+        if (!in->number(&f)) return false;
+        binlog_appendf(out, "%g", f);
+        return true;
+      case 'p':
+        if (!in->number(&u)) return false;
+        binlog_appendf(out, "0x%llx", static_cast<unsigned long long>(u));
+        return true;
+      case 's':
+        if (!in->string(&s, &len)) return false;
+        out->append(s, len);
+        return true;
+      default:
+        return false;
+    }
+}
+
+}  // namespace internal
+
+/**
+ * printf format with the encoded arguments into *out.  Length modifiers
+ * are ignored, the argument's tag decides its width; missing arguments
+ * render as nothing.  false if the arguments are corrupt.
+ */
+inline bool binlog_render(const std::string& format, const char* args, size_t len, std::string* out) {
+    internal::binlog_reader in(args, len);
+    size_t i = 0;
+    while (i < format.size()) {
+        char c = format[i];
+        if (c != '%') {
+            size_t next = format.find('%', i);
+            if (next == std::string::npos) {
+                next = format.size();
+            }
+            out->append(format, i, next - i);
+            i = next;
+            continue;
+        }
+        if (i + 1 < format.size() && format[i + 1] == '%') {
+            out->push_back('%');
+            i += 2;
+            continue;
+        }
+        // %[flags][width][.precision][length]conversion
+        std::string spec("%");
+        i++;
+        while (i < format.size() && strchr("-+ #0'", format[i]) != 0) {
+            spec += format[i++];
+        }
+        internal::binlog_spec_number(format, &i, &in, &spec);
+        if (i < format.size() && format[i] == '.') {
+            spec += format[i++];
+            internal::binlog_spec_number(format, &i, &in, &spec);
+        }
+        while (i < format.size() && strchr("hlLqjzt", format[i]) != 0) {
+            i++;
+        }
+        if (i == format.size()) {
+            break;
+        }
+        char conversion = format[i++];
+        if (!in.more()) {
+            continue;
+        }
+        char tag = in.peek();
+        if ((tag == 'i' || tag == 'u') && strchr("diouxXc", conversion) != 0) {
+            int64_t v;
+            if (!in.number(&v)) {
+                return false;
+            }
+            if (conversion == 'c') {
+                internal::binlog_appendf(out, spec + 'c', static_cast<int>(v));
+            }
+            else if (conversion == 'd' || conversion == 'i') {
+                internal::binlog_appendf(out, spec + "ll" + conversion, static_cast<long long>(v));
+            }
+            else {
+                internal::binlog_appendf(out, spec + "ll" + conversion, static_cast<unsigned long long>(v));
+            }
+        }
+        else if (tag == 'f' && strchr("eEfFgGaA", conversion) != 0) {
+            double v;
+            if (!in.number(&v)) {
+                return false;
+            }
+            internal::binlog_appendf(out, spec + conversion, v);
+        }
+        else if (tag == 's' && conversion == 's') {
+            const char* s;
+            size_t n;
+            if (!in.string(&s, &n)) {
+                return false;
+            }
+            if (spec.size() == 1) {
+                out->append(s, n);
+            }
+            else {
+                // precision may cut it, width may pad it
+                internal::binlog_appendf(out, spec + 's', std::string(s, n).c_str());
+            }
+        }
+        else if (tag == 'p' && conversion == 'p') {
+            uint64_t v;
+            if (!in.number(&v)) {
+                return false;
+            }
+            internal::binlog_appendf(out, spec + 'p', reinterpret_cast<void*>(static_cast<uintptr_t>(v)));
+        }
+        else if (!internal::binlog_render_any(&in, out)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * binlog file records
+ *  A binary log file is a sequence of records, each a uint32 length of
+ *  what follows, a kind byte and:
+ *      'H' header      app name '\0' time format '\0' separator, pid uint32
+ *      'F' format      id uint32, level name '\0' format text
+ *      'E' event       id uint32, usecs int64, tid uint32, the arguments
+ *      'T' text        a line formatted already
+ *  A format record precedes the first event of its id in each file.
+ *
+ *  No record is longer than BINLOG_MAX_RECORD: log::defer() formats a
+ *  call whose arguments take more than a line may at once, as text, and
+ *  XD_LOG_DEFER takes no format over BINLOG_MAX_FORMAT.  A reader rejects
+ *  a longer length as corrupt before reading it.
+ */
+namespace internal {
+
+static const uint32_t BINLOG_MAX_RECORD = 1024 * 1024;
+static const uint32_t BINLOG_MAX_FORMAT = 64 * 1024;
+
+inline void binlog_begin(std::string* out, char kind) {
+    out->clear();
+    out->append(sizeof(uint32_t), '\0');
+    out->push_back(kind);
+}
+inline void binlog_end(std::string* out) {
+    uint32_t n = static_cast<uint32_t>(out->size() - sizeof(n));
+    memcpy(&(*out)[0], &n, sizeof(n));
+}
+template <typename V>
+inline void binlog_raw(std::string* out, V v) {
+    out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+}  // namespace internal
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_BINLOG_H__
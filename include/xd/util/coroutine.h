@@ -0,0 +1,108 @@
+#ifndef __XD_UTIL_COROUTINE_H__
+#define __XD_UTIL_COROUTINE_H__
+
+#include <xd/topdef.h>
+
+#ifdef XD_HAVE_COROUTINES
+
+#include <coroutine>
+
+namespace xd { namespace util {
+
+namespace internal {
+
+/**
+ * co_waiter
+ *  A coroutine suspended in a co_* awaitable, linked into the list of the
+ *  object it waits on.  It lives in the coroutine frame, so it stays put
+ *  until resumed.  resume() posts the handle to the Executor given to
+ *  co_*, anything with
+ *      template <typename F> void post(F f);
+ *  such as xd::util::executor, which then runs it on one of its threads.
+ */
+class co_waiter {
+  public:
+    template <typename Executor>
+    explicit co_waiter(Executor& ex): m_next(0), m_executor(&ex), m_post(&post<Executor>) {
+    }
+    void suspend(std::coroutine_handle<> handle) {
+        m_handle = handle;
+    }
+    void resume(void) {
+        m_post(m_executor, m_handle);
+    }
+
+  private:
+    template <typename Executor>
+    static void post(void* ex, std::coroutine_handle<> handle) {
+        static_cast<Executor*>(ex)->post([handle]() { handle.resume(); });
+    }
+
+  private:
+    friend class co_waiter_list;
+    co_waiter* m_next;
+    std::coroutine_handle<> m_handle;
+    void* m_executor;
+    void (*m_post)(void*, std::coroutine_handle<>);
+};
+
+/**
+ * co_waiter_list
+ *  Intrusive FIFO of co_waiters, serialized by its owner.
+ */
+class co_waiter_list {
+  public:
+    co_waiter_list(): m_head(0), m_tail(0) {
+    }
+    bool empty(void) const {
+        return m_head == 0;
+    }
+    co_waiter* front(void) const {
+        return m_head;
+    }
+    void push_back(co_waiter* w) {
+        w->m_next = 0;
+        if (m_tail) {
+            m_tail->m_next = w;
+        }
+        else {
+            m_head = w;
+        }
+        m_tail = w;
+    }
+    co_waiter* pop_front(void) {
+        co_waiter* w = m_head;
+        m_head = w->m_next;
+        if (m_head == 0) {
+            m_tail = 0;
+        }
+        return w;
+    }
+    void swap(co_waiter_list& other) {
+        std::swap(m_head, other.m_head);
+        std::swap(m_tail, other.m_tail);
+    }
+    // resume all, leaving the list empty
+    void resume_all(void) {
+        while (!empty()) {
+            pop_front()->resume();
+        }
+    }
+
+  private:
+    co_waiter_list(const co_waiter_list&);
+    co_waiter_list& operator=(const co_waiter_list&);
+
+  private:
+    co_waiter* m_head;
+    co_waiter* m_tail;
+};
+
+}  // namespace internal
+
+} // namespace util
+} // namespace xd
+
+#endif  // XD_HAVE_COROUTINES
+
+#endif  // !__XD_UTIL_COROUTINE_H__
@@ -0,0 +1,43 @@
+#ifndef __XD_UTIL_DEADLINE_H__
+#define __XD_UTIL_DEADLINE_H__
+
+#include <IceUtil/Time.h>
+
+namespace xd { namespace util {
+
+/**
+ * deadline
+ *  An absolute point on the monotonic clock.  Every timed wait is given
+ *  only what is left of the budget, so spurious wake-ups, lost races and
+ *  retry passes never stretch a timed call beyond its usecs.
+ */
+class deadline {
+  public:
+    explicit deadline(unsigned usecs):
+      m_when(now() + IceUtil::Time::microSeconds(static_cast<IceUtil::Int64>(usecs))) {
+    }
+    // at when, a point on the monotonic clock
+    explicit deadline(const IceUtil::Time& when): m_when(when) {
+    }
+    static IceUtil::Time now(void) {
+        return IceUtil::Time::now(IceUtil::Time::Monotonic);
+    }
+    IceUtil::Time remaining(void) const {
+        IceUtil::Time left = m_when - now();
+        return left > IceUtil::Time() ? left : IceUtil::Time();
+    }
+    const IceUtil::Time& when(void) const {
+        return m_when;
+    }
+    bool expired(void) const {
+        return remaining() == IceUtil::Time();
+    }
+
+  private:
+    IceUtil::Time m_when;
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_DEADLINE_H__
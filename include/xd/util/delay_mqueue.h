@@ -0,0 +1,243 @@
+#ifndef __XD_UTIL_DELAY_MQUEUE_H__
+#define __XD_UTIL_DELAY_MQUEUE_H__
+
+#include <IceUtil/Mutex.h>
+#include <IceUtil/Time.h>
+
+#include <cassert>
+#include <vector>
+
+#include <xd/topdef.h>
+#include <xd/util/deadline.h>
+#include <xd/util/waitqueue.h>
+
+namespace xd { namespace util {
+
+/**
+ * delay_mqueue
+ *  Unbounded queue of items each released at its own time on the
+ *  monotonic clock; get() waits until the earliest one is due.  Items due
+ *  at the same time come out in put order.
+ *
+ *      xd::util::delay_mqueue<request> retries;
+ *      retries.put_after(500 * 1000, req);     // back in 500ms
+ *
+ *  Pending items sit in a 4-ary heap, O(log n) put and get with half the
+ *  depth of a binary heap.  Only one waiting consumer, the leader, sleeps
+ *  until the earliest due time; the others sleep untimed and are woken one
+ *  at a time, so a due batch costs a single timer wake-up, drained by the
+ *  batch get.
+ */
+template <typename T>
+class delay_mqueue {
+  public:
+    explicit delay_mqueue(const wait_policy& policy = wait_policy()):
+      m_policy(policy),
+      m_seq(0),
+      m_leader(0) {
+    }
+    size_t size(void) const {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        return m_heap.size();
+    }
+    /**
+     * when the earliest item is due, false if there is none.
+     */
+    bool next_due(IceUtil::Time* when) const {
+        assert(when != 0);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        if (m_heap.empty()) {
+            return false;
+        }
+        *when = IceUtil::Time::microSeconds(m_heap.front().when);
+        return true;
+    }
+    // due at once
+    void put(const T& item) {
+        put_at(deadline::now(), item);
+        return;
+    }
+    void put_after(unsigned usecs, const T& item) {
+        put_at(deadline(usecs).when(), item);
+        return;
+    }
+    void put_at(const IceUtil::Time& when, const T& item) {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        push(entry(when.toMicroSeconds(), m_seq++, item));
+        return;
+    }
+    T get(void) {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        wait_for_due(lock, 0);
+        T item(XD_MOVE(m_heap.front().item));
+        pop();
+        return item;
+    }
+    /**
+     * false if no item fell due within usecs.
+     */
+    bool timed_get(unsigned usecs, T* item) {
+        assert(item != 0);
+        deadline until(usecs);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        if (!wait_for_due(lock, &until)) {
+            return false;
+        }
+        *item = XD_MOVE(m_heap.front().item);
+        pop();
+        return true;
+    }
+    /**
+     * up to n of the items due, in due order, once one is.
+     */
+    template <typename OutputIterator>
+    size_t get(OutputIterator oit, size_t n) {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        wait_for_due(lock, 0);
+        return take(oit, n);
+    }
+    template <typename OutputIterator>
+    bool timed_get(unsigned usecs, OutputIterator oit, size_t n, size_t* m = 0) {
+        deadline until(usecs);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        if (!wait_for_due(lock, &until)) {
+            return false;
+        }
+        size_t i = take(oit, n);
+        if (m) *m = i;
+        return true;
+    }
+
+  private:
+    struct entry {
+        entry(IceUtil::Int64 when_, unsigned long long seq_, const T& item_):
+          when(when_),
+          seq(seq_),
+          item(item_) {
+        }
+        bool operator<(const entry& other) const {
+            return when < other.when || (when == other.when && seq < other.seq);
+        }
+        IceUtil::Int64 when;    // usecs on the monotonic clock
+        unsigned long long seq;
+        T item;
+    };
+
+  private:
+    bool due(void) const {
+        return !m_heap.empty() && m_heap.front().when <= deadline::now().toMicroSeconds();
+    }
+    /**
+     * wait until the earliest item is due or until passed.  The leader
+     * sleeps to the due time, the rest without a timeout; whoever leaves
+     * with items still queued wakes the next one to lead.
+     */
+    bool wait_for_due(IceUtil::Mutex::Lock& lock, const deadline* until) {
+        const void* self = &lock;
+        bool waited = true;
+        while (waited && !due()) {
+            if (m_heap.empty() || m_leader != 0) {
+                waited = wait(lock, until);
+                continue;
+            }
+            m_leader = self;
+            deadline top(IceUtil::Time::microSeconds(m_heap.front().when));
+            bool mine = (until == 0 || top.when() < until->when());
+            waited = wait(lock, mine ? &top : until);
+            if (m_leader == self) {
+                m_leader = 0;
+            }
+            if (!waited && mine) {
+                waited = true;
+            }
+        }
+        bool got = due();
+        if (m_leader == 0 && m_heap.size() > (got ? 1u : 0u)) {
+            m_forDue.notify(1);
+        }
+        return got;
+    }
+    bool wait(IceUtil::Mutex::Lock& lock, const deadline* until) {
+        int ticket = m_forDue.prepare_wait();
+        lock.release();
+        bool waited = m_forDue.wait(ticket, m_policy, until);
+        lock.acquire();
+        return waited;
+    }
+    // a new earliest item takes the lead from the sleeping leader
+    void push(const entry& e) {
+        size_t hole = m_heap.size();
+        m_heap.push_back(e);
+        while (hole > 0) {
+            size_t parent = (hole - 1) / ARITY;
+            if (!(m_heap[hole] < m_heap[parent])) {
+                break;
+            }
+            std::swap(m_heap[hole], m_heap[parent]);
+            hole = parent;
+        }
+        if (hole == 0) {
+            m_leader = 0;
+            m_forDue.notify(1);
+        }
+    }
+    void pop(void) {
+        if (m_heap.size() > 1) {
+            std::swap(m_heap.front(), m_heap.back());
+        }
+        m_heap.pop_back();
+        size_t size = m_heap.size();
+        size_t hole = 0;
+        for (;;) {
+            size_t first = hole * ARITY + 1;
+            if (first >= size) {
+                break;
+            }
+            size_t least = first;
+            size_t last = (first + ARITY < size ? first + ARITY : size);
+            for (size_t c = first + 1; c < last; c++) {
+                if (m_heap[c] < m_heap[least]) {
+                    least = c;
+                }
+            }
+            if (!(m_heap[least] < m_heap[hole])) {
+                break;
+            }
+            std::swap(m_heap[hole], m_heap[least]);
+            hole = least;
+        }
+    }
+    template <typename OutputIterator>
+    size_t take(OutputIterator oit, size_t n) {
+        IceUtil::Int64 now = deadline::now().toMicroSeconds();
+        size_t i;
+        for (i = 0; i < n && !m_heap.empty() && m_heap.front().when <= now; i++) {
+            *oit = XD_MOVE(m_heap.front().item);
+            oit++;
+            pop();
+        }
+        return i;
+    }
+
+  private:
+    static const size_t ARITY = 4;
+
+  private:
+    // non-copyable
+    delay_mqueue(const delay_mqueue&);
+    delay_mqueue& operator=(const delay_mqueue&);
+
+  private:
+    wait_policy m_policy;
+    std::vector<entry> m_heap;
+    unsigned long long m_seq;
+    const void* m_leader;       // the consumer sleeping to the due time
+
+    IceUtil::Mutex m_mutex;
+    waitqueue m_forDue;
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_DELAY_MQUEUE_H__
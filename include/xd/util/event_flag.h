@@ -0,0 +1,82 @@
+#ifndef __XD_UTIL_EVENT_FLAG_H__
+#define __XD_UTIL_EVENT_FLAG_H__
+
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <xd/topdef.h>
+
+namespace xd { namespace util {
+
+/**
+ * event_flag
+ *  A level-triggered eventfd(2): the fd polls readable exactly while the
+ *  flag is set.  assign() makes a syscall only when the level changes, and
+ *  nothing at all until open() was called.  The owner serializes calls,
+ *  pollers must not read the fd themselves.
+ */
+class event_flag {
+  public:
+    event_flag(): m_fd(-1), m_set(false) {
+    }
+    ~event_flag() {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+    }
+    /**
+     * the fd, made on first call with the given level.
+     */
+    int open(bool set) {
+        if (m_fd < 0) {
+            m_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (m_fd < 0) {
+                throw std::runtime_error(_("eventfd error -- ") + std::string(strerror(errno)));
+            }
+            assign(set);
+        }
+        return m_fd;
+    }
+    bool opened(void) const {
+        return m_fd >= 0;
+    }
+    void assign(bool set) {
+        if (m_fd < 0 || set == m_set) {
+            return;
+        }
+        int errno_saved = errno;
+        uint64_t value = 1;
+        if (set) {
+            while (::write(m_fd, &value, sizeof(value)) < 0 && errno == EINTR) {
+                continue;
+            }
+        }
+        else {
+            while (::read(m_fd, &value, sizeof(value)) < 0 && errno == EINTR) {
+                continue;
+            }
+        }
+        errno = errno_saved;
+        m_set = set;
+    }
+
+  private:
+    // non-copyable
+    event_flag(const event_flag&);
+    event_flag& operator=(const event_flag&);
+
+  private:
+    int m_fd;
+    bool m_set;
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_EVENT_FLAG_H__
@@ -0,0 +1,408 @@
+#ifndef __XD_UTIL_EXECUTOR_H__
+#define __XD_UTIL_EXECUTOR_H__
+
+#include <IceUtil/Thread.h>
+
+#include <cassert>
+#include <exception>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <xd/topdef.h>
+#include <xd/util/mpmc_ring.h>
+#include <xd/util/waitqueue.h>
+
+#ifndef XD_HAVE_CXX11
+#   error "xd/util/executor.h needs C++11"
+#endif
+
+namespace xd { namespace util {
+
+namespace internal {
+
+class task {
+  public:
+    virtual ~task() {
+    }
+    virtual void run(void) = 0;
+};
+
+template <typename F>
+class callable_task: public task {
+  public:
+    explicit callable_task(F&& f): m_f(std::move(f)) {
+    }
+    virtual void run(void) {
+        m_f();
+    }
+
+  private:
+    F m_f;
+};
+
+/**
+ * ws_deque
+ *  Chase-Lev work-stealing deque of task pointers with a fixed capacity.
+ *  Only the owner pushes and pops at the bottom, any thread may steal
+ *  from the top.
+ */
+class ws_deque {
+  public:
+    explicit ws_deque(size_t volumn):
+      m_mask(volumn - 1),
+      m_slots(new task*[volumn]),
+      m_top(0),
+      m_bottom(0) {
+        assert(volumn > 0 && (volumn & m_mask) == 0);
+    }
+    ~ws_deque() {
+        delete[] m_slots;
+    }
+    // owner only, false when full
+    bool push(task* t) {
+        long b = __atomic_load_n(&m_bottom, __ATOMIC_RELAXED);
+        long top = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+        if (static_cast<size_t>(b - top) > m_mask) {
+            return false;
+        }
+        __atomic_store_n(&m_slots[b & m_mask], t, __ATOMIC_RELAXED);
+        __atomic_store_n(&m_bottom, b + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    // owner only
+    task* pop(void) {
+        long b = __atomic_load_n(&m_bottom, __ATOMIC_RELAXED) - 1;
+        __atomic_store_n(&m_bottom, b, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long top = __atomic_load_n(&m_top, __ATOMIC_RELAXED);
+        if (top > b) {
+            __atomic_store_n(&m_bottom, b + 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        task* t = __atomic_load_n(&m_slots[b & m_mask], __ATOMIC_RELAXED);
+        if (top == b) {
+            if (!__atomic_compare_exchange_n(&m_top, &top, top + 1, false,
+                                             __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                t = 0;
+            }
+            __atomic_store_n(&m_bottom, b + 1, __ATOMIC_RELAXED);
+        }
+        return t;
+    }
+    // any thread
+    task* steal(void) {
+        long top = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long b = __atomic_load_n(&m_bottom, __ATOMIC_ACQUIRE);
+        if (top >= b) {
+            return 0;
+        }
+        task* t = __atomic_load_n(&m_slots[top & m_mask], __ATOMIC_RELAXED);
+        if (!__atomic_compare_exchange_n(&m_top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+        return t;
+    }
+    bool empty(void) const {
+        long top = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+        return __atomic_load_n(&m_bottom, __ATOMIC_ACQUIRE) <= top;
+    }
+
+  private:
+    // non-copyable
+    ws_deque(const ws_deque&);
+    ws_deque& operator=(const ws_deque&);
+
+  private:
+    const size_t m_mask;
+    task** const m_slots;
+
+    char m_pad0[XD_CACHELINE_SIZE];
+    long m_top;                 // stolen from by CAS
+
+    char m_pad1[XD_CACHELINE_SIZE - sizeof(long)];
+    long m_bottom;              // owner only
+
+    char m_pad2[XD_CACHELINE_SIZE - sizeof(long)];
+};
+
+// the executor and worker index of the calling thread, if it is a worker
+inline const void*& this_executor(void) {
+    static __thread const void* owner = 0;
+    return owner;
+}
+
+inline size_t& this_worker(void) {
+    static __thread size_t index = 0;
+    return index;
+}
+
+}  // namespace internal
+
+/**
+ * executor
+ *  Work-stealing thread pool.  Each worker owns a Chase-Lev deque, tasks
+ *  submitted from a worker go to its own deque and others go to a global
+ *  injection ring.  An idle worker pops its deque, then the injection
+ *  ring, then steals from the other workers, and parks on m_idle when
+ *  there is nothing anywhere.
+ *
+ *      xd::util::executor pool(8);
+ *      std::future<int> f = pool.submit([] { return 42; });
+ *      pool.parallel_for(0, n, [&](size_t i) { ... });
+ *
+ *  The destructor runs what is still queued before joining the workers.
+ */
+class executor {
+  public:
+    static const size_t DEQUE_VOLUMN = 4096;
+    static const size_t INJECTION_VOLUMN = 64 * 1024;
+
+  public:
+    explicit executor(size_t workers, const wait_policy& policy = wait_policy(256, 4)):
+      m_injection(INJECTION_VOLUMN),
+      m_policy(policy),
+      m_stopping(false),
+      m_nPending(0) {
+        if (workers == 0) {
+            throw std::invalid_argument(_("executor needs at least one worker"));
+        }
+        for (size_t i = 0; i < workers; i++) {
+            m_deques.push_back(new internal::ws_deque(DEQUE_VOLUMN));
+        }
+        for (size_t i = 0; i < workers; i++) {
+            IceUtil::ThreadPtr w = new worker(this, i);
+            m_controls.push_back(w->start());
+            m_workers.push_back(w);
+        }
+    }
+    ~executor() {
+        __atomic_store_n(&m_stopping, true, __ATOMIC_SEQ_CST);
+        m_idle.notify_all();
+        for (size_t i = 0; i < m_controls.size(); i++) {
+            m_controls[i].join();
+        }
+        for (size_t i = 0; i < m_deques.size(); i++) {
+            delete m_deques[i];
+        }
+    }
+    size_t workers(void) const {
+        return m_deques.size();
+    }
+    /**
+     * run f on some worker, its result or exception comes back through
+     * the future.
+     */
+    template <typename F>
+    auto submit(F f) -> std::future<decltype(f())> {
+        typedef decltype(f()) result_type;
+        std::packaged_task<result_type()> pt(std::move(f));
+        std::future<result_type> result = pt.get_future();
+        post(std::move(pt));
+        return result;
+    }
+    /**
+     * fire and forget, exceptions escaping f are dropped.
+     */
+    template <typename F>
+    void post(F f) {
+        schedule(new internal::callable_task<F>(std::move(f)));
+    }
+    /**
+     * f(i) for every i in [first, last), split in halves down to grain
+     * sized chunks so idle workers steal big pieces first.  The caller
+     * runs tasks too until the whole range is done.
+     */
+    template <typename F>
+    void parallel_for(size_t first, size_t last, F f, size_t grain = 1) {
+        if (first >= last) {
+            return;
+        }
+        std::shared_ptr<range_latch> latch(new range_latch());
+        schedule(new range_task<F>(this, latch, &f, first, last, grain > 0 ? grain : 1));
+        help_until(latch.get());
+        if (latch->error) {
+            std::rethrow_exception(latch->error);
+        }
+    }
+
+  private:
+    class worker: public IceUtil::Thread {
+      public:
+        worker(executor* owner, size_t index): m_owner(owner), m_index(index) {
+        }
+        virtual void run(void) {
+            internal::this_executor() = m_owner;
+            internal::this_worker() = m_index;
+            m_owner->work(m_index);
+        }
+
+      private:
+        executor* m_owner;
+        size_t m_index;
+    };
+
+    // shared with the tasks, the last one may still be in notify_all()
+    // when parallel_for returns
+    struct range_latch {
+        range_latch(): pending(1), failed(0) {
+        }
+        long pending;
+        int failed;
+        std::exception_ptr error;   // the first f() which threw
+        waitqueue done;
+    };
+
+    template <typename F>
+    class range_task: public internal::task {
+      public:
+        range_task(executor* owner, const std::shared_ptr<range_latch>& latch, F* f,
+                   size_t first, size_t last, size_t grain):
+          m_owner(owner), m_latch(latch), m_f(f), m_first(first), m_last(last), m_grain(grain) {
+        }
+        virtual void run(void) {
+            size_t last = m_last;
+            try {
+                while (last - m_first > m_grain) {
+                    size_t mid = m_first + (last - m_first) / 2;
+                    __atomic_add_fetch(&m_latch->pending, 1, __ATOMIC_RELAXED);
+                    m_owner->schedule(new range_task(m_owner, m_latch, m_f, mid, last, m_grain));
+                    last = mid;
+                }
+                for (size_t i = m_first; i < last; i++) {
+                    (*m_f)(i);
+                }
+            }
+            catch (...) {
+                if (__atomic_exchange_n(&m_latch->failed, 1, __ATOMIC_ACQ_REL) == 0) {
+                    m_latch->error = std::current_exception();
+                }
+            }
+            if (__atomic_sub_fetch(&m_latch->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+                m_latch->done.notify_all();
+            }
+        }
+
+      private:
+        executor* m_owner;
+        std::shared_ptr<range_latch> m_latch;
+        F* m_f;
+        size_t m_first;
+        size_t m_last;
+        size_t m_grain;
+    };
+
+  private:
+    bool on_worker(void) const {
+        return internal::this_executor() == this;
+    }
+    void schedule(internal::task* t) {
+        __atomic_add_fetch(&m_nPending, 1, __ATOMIC_RELAXED);
+        if (!on_worker() || !m_deques[internal::this_worker()]->push(t)) {
+            while (!m_injection.try_put(t)) {
+                // the injection ring is full: run something ourselves
+                internal::task* other = find();
+                if (other != 0) {
+                    execute(other);
+                }
+                else {
+                    sched_yield();
+                }
+            }
+        }
+        m_idle.notify(1);
+    }
+    internal::task* find(void) {
+        internal::task* t = 0;
+        if (on_worker()) {
+            t = m_deques[internal::this_worker()]->pop();
+        }
+        if (t == 0) {
+            m_injection.try_get(&t);
+        }
+        if (t == 0) {
+            size_t n = m_deques.size();
+            size_t start = on_worker() ? internal::this_worker() + 1 : 0;
+            for (size_t k = 0; t == 0 && k < n; k++) {
+                t = m_deques[(start + k) % n]->steal();
+            }
+        }
+        return t;
+    }
+    void execute(internal::task* t) {
+        try {
+            t->run();
+        }
+        catch (...) {
+            // post()ed tasks have nowhere to report to
+        }
+        delete t;
+        if (__atomic_sub_fetch(&m_nPending, 1, __ATOMIC_SEQ_CST) == 0 &&
+            __atomic_load_n(&m_stopping, __ATOMIC_SEQ_CST)) {
+            m_idle.notify_all();
+        }
+    }
+    bool idle(void) const {
+        return __atomic_load_n(&m_nPending, __ATOMIC_ACQUIRE) == 0;
+    }
+    void work(size_t index) {
+        for (;;) {
+            internal::task* t = find();
+            if (t != 0) {
+                execute(t);
+                continue;
+            }
+            int ticket = m_idle.prepare_wait();
+            if ((t = find()) != 0) {
+                m_idle.cancel_wait();
+                execute(t);
+                continue;
+            }
+            if (__atomic_load_n(&m_stopping, __ATOMIC_SEQ_CST) && idle()) {
+                m_idle.cancel_wait();
+                break;
+            }
+            m_idle.wait(ticket, m_policy, 0);
+        }
+        (void)index;
+    }
+    void help_until(range_latch* latch) {
+        while (__atomic_load_n(&latch->pending, __ATOMIC_ACQUIRE) != 0) {
+            internal::task* t = find();
+            if (t != 0) {
+                execute(t);
+                continue;
+            }
+            int ticket = latch->done.prepare_wait();
+            if (__atomic_load_n(&latch->pending, __ATOMIC_ACQUIRE) == 0) {
+                latch->done.cancel_wait();
+                break;
+            }
+            latch->done.wait(ticket, m_policy, 0);
+        }
+    }
+
+  private:
+    // non-copyable
+    executor(const executor&);
+    executor& operator=(const executor&);
+
+  private:
+    std::vector<internal::ws_deque*> m_deques;
+    mpmc_ring<internal::task*> m_injection;
+    wait_policy m_policy;
+    bool m_stopping;
+    long m_nPending;            // scheduled but not yet finished
+    waitqueue m_idle;
+    std::vector<IceUtil::ThreadPtr> m_workers;
+    std::vector<IceUtil::ThreadControl> m_controls;
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_EXECUTOR_H__
@@ -64,7 +64,6 @@ class fsrouter {
     size_t m_count;
 };
 
-}
 }
 }
 #endif // __XD_UTIL_fsrouter_H__
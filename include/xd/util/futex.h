@@ -0,0 +1,53 @@
+#ifndef __XD_UTIL_FUTEX_H__
+#define __XD_UTIL_FUTEX_H__
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <cerrno>
+
+#include <IceUtil/Time.h>
+
+namespace xd { namespace util {
+
+/**
+ * futex_wait
+ *  Sleep while *addr == expected, for at most timeout (0 for no limit).
+ *  Returns false only on timeout; a wake-up, a changed *addr, a signal or
+ *  a spurious return all give true and the caller re-checks.
+ *  shared selects the process-shared flavour for words in shared memory.
+ */
+inline bool futex_wait(int* addr, int expected, const IceUtil::Time* timeout = 0, bool shared = false) {
+    struct timespec ts;
+    struct timespec* tsp = 0;
+    if (timeout != 0) {
+        IceUtil::Int64 usecs = timeout->toMicroSeconds();
+        ts.tv_sec = static_cast<time_t>(usecs / 1000000);
+        ts.tv_nsec = static_cast<long>(usecs % 1000000) * 1000;
+        tsp = &ts;
+    }
+    int op = shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE;
+    int errno_saved = errno;
+    bool timedout = (::syscall(SYS_futex, addr, op, expected, tsp, 0, 0) == -1 && errno == ETIMEDOUT);
+    errno = errno_saved;
+    return !timedout;
+}
+
+/**
+ * futex_wake
+ *  Wake at most n threads sleeping on addr, returns how many were woken.
+ */
+inline int futex_wake(int* addr, int n, bool shared = false) {
+    int op = shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE;
+    int errno_saved = errno;
+    long woken = ::syscall(SYS_futex, addr, op, n, 0, 0, 0);
+    errno = errno_saved;
+    return woken > 0 ? static_cast<int>(woken) : 0;
+}
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_FUTEX_H__
@@ -0,0 +1,204 @@
+#ifndef __XD_UTIL_KEYED_MQUEUE_H__
+#define __XD_UTIL_KEYED_MQUEUE_H__
+
+#include <IceUtil/Mutex.h>
+
+#include <cassert>
+#include <deque>
+#include <limits>
+#include <map>
+#include <utility>
+
+#include <xd/topdef.h>
+#include <xd/util/deadline.h>
+#include <xd/util/waitqueue.h>
+
+namespace xd { namespace util {
+
+/**
+ * replace_merge
+ *  keyed_mqueue's default Merge, the newest update wins.
+ */
+struct replace_merge {
+    template <typename V>
+    void operator()(V& pending, const V& update) const {
+        pending = update;
+    }
+};
+
+/**
+ * keyed_mqueue
+ *  Coalescing mqueue of (key, value) updates.  A put for a key which is
+ *  already queued does not append, Merge folds the update into the
+ *  pending value:
+ *      void operator()(V& pending, const V& update) const;
+ *  Keys come out in the order they first arrived since their last get, so
+ *  a hot key keeps its place instead of being starved or duplicated.
+ *  volumn bounds the distinct keys queued, a merging put never waits.
+ *
+ *      xd::util::keyed_mqueue<entity_id, state> q(10000);
+ *      q.put(id, s);
+ *      std::pair<entity_id, state> u = q.get();
+ */
+template <typename K, typename V, typename Merge = replace_merge>
+class keyed_mqueue {
+  public:
+    typedef std::pair<K, V> value_type;
+
+  public:
+    keyed_mqueue(size_t volumn = std::numeric_limits<size_t>::max(),
+                 const wait_policy& policy = wait_policy(),
+                 const Merge& merge = Merge()):
+      m_volumn(volumn),
+      m_policy(policy),
+      m_merge(merge),
+      m_nMerged(0) {
+    }
+    size_t size(void) const {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        return m_order.size();
+    }
+    // puts folded into a pending value so far
+    unsigned long long merged(void) const {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        return m_nMerged;
+    }
+    void put(const K& key, const V& value) {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        merge_or_insert(lock, key, value, 0);
+        return;
+    }
+    bool timed_put(unsigned usecs, const K& key, const V& value) {
+        deadline until(usecs);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        return merge_or_insert(lock, key, value, &until);
+    }
+    void get(K* key, V* value) {
+        assert(key != 0 && value != 0);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        wait_for_not_empty(lock, 0);
+        pop(key, value);
+        return;
+    }
+    value_type get(void) {
+        value_type item;
+        get(&item.first, &item.second);
+        return item;
+    }
+    bool timed_get(unsigned usecs, K* key, V* value) {
+        assert(key != 0 && value != 0);
+        deadline until(usecs);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        if (!wait_for_not_empty(lock, &until)) {
+            return false;
+        }
+        pop(key, value);
+        return true;
+    }
+    /**
+     * up to n (key, value) pairs through oit.
+     */
+    template <typename OutputIterator>
+    size_t get(OutputIterator oit, size_t n) {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        wait_for_not_empty(lock, 0);
+        return take(oit, n);
+    }
+    template <typename OutputIterator>
+    bool timed_get(unsigned usecs, OutputIterator oit, size_t n, size_t* m = 0) {
+        deadline until(usecs);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        if (!wait_for_not_empty(lock, &until)) {
+            return false;
+        }
+        size_t i = take(oit, n);
+        if (m) *m = i;
+        return true;
+    }
+
+  private:
+    typedef std::map<K, V> pending_type;
+
+  private:
+    /**
+     * merge into the pending value, or queue key once there is room.  the
+     * key is looked up again after every wait, a get or another put may
+     * have taken or added it meanwhile.
+     */
+    bool merge_or_insert(IceUtil::Mutex::Lock& lock, const K& key, const V& value,
+                         const deadline* until) {
+        for (;;) {
+            typename pending_type::iterator it = m_pending.lower_bound(key);
+            if (it != m_pending.end() && !(key < it->first)) {
+                m_merge(it->second, value);
+                m_nMerged++;
+                return true;
+            }
+            if (m_order.size() < m_volumn) {
+                m_pending.insert(it, value_type(key, value));
+                m_order.push_back(key);
+                m_forNotEmpty.notify(1);
+                return true;
+            }
+            if (!wait(m_forNotFull, lock, until)) {
+                return false;
+            }
+        }
+    }
+    bool wait_for_not_empty(IceUtil::Mutex::Lock& lock, const deadline* until) {
+        bool waited = true;
+        while (waited && m_order.empty()) {
+            waited = wait(m_forNotEmpty, lock, until);
+        }
+        return !m_order.empty();
+    }
+    bool wait(waitqueue& wq, IceUtil::Mutex::Lock& lock, const deadline* until) {
+        int ticket = wq.prepare_wait();
+        lock.release();
+        bool waited = wq.wait(ticket, m_policy, until);
+        lock.acquire();
+        return waited;
+    }
+    void pop(K* key, V* value) {
+        typename pending_type::iterator it = m_pending.find(m_order.front());
+        assert(it != m_pending.end());
+        *key = it->first;
+        *value = XD_MOVE(it->second);
+        m_pending.erase(it);
+        m_order.pop_front();
+        m_forNotFull.notify(1);
+    }
+    template <typename OutputIterator>
+    size_t take(OutputIterator oit, size_t n) {
+        size_t i;
+        for (i = 0; i < n && !m_order.empty(); i++) {
+            value_type item;
+            pop(&item.first, &item.second);
+            *oit = XD_MOVE(item);
+            oit++;
+        }
+        return i;
+    }
+
+  private:
+    // non-copyable
+    keyed_mqueue(const keyed_mqueue&);
+    keyed_mqueue& operator=(const keyed_mqueue&);
+
+  private:
+    const size_t m_volumn;
+    wait_policy m_policy;
+    Merge m_merge;
+    std::deque<K> m_order;      // keys by first arrival
+    pending_type m_pending;
+    unsigned long long m_nMerged;
+
+    IceUtil::Mutex m_mutex;
+    waitqueue m_forNotFull;
+    waitqueue m_forNotEmpty;
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_KEYED_MQUEUE_H__
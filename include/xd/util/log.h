@@ -10,25 +10,187 @@
 #include <sys/types.h>
 #include <stdio.h>
 
+#include <algorithm>
 #include <string>
 #include <cstring>
 #include <iostream>
-#include <fstream>
+#include <iterator>
 #include <sstream>
 #include <vector>
 #include <stdexcept>
 
 #include <xd/topdef.h>
+#include <xd/util/binlog.h>
+#include <xd/util/coroutine.h>
+#include <xd/util/log_file.h>
+#include <xd/util/log_format.h>
+#include <xd/util/deadline.h>
 #include <xd/util/strconv.h>
+#include <xd/util/waitqueue.h>
+
+#ifdef XD_HAVE_COROUTINES
+#   include <exception>
+#endif
 
 namespace xd { namespace util {
 
+namespace internal {
+
+struct log_entry {
+    log_entry(): stamp(0), seq(0), when(0), format(0), tid(0) {
+    }
+    IceUtil::Int64 stamp;       // usecs, orders the lines of different threads
+    unsigned long seq;          // orders one thread's lines within a usec
+    time_t when;
+    unsigned format;            // binlog_formats id of a deferred line, 0 for text
+    unsigned tid;
+    std::string line;           // the text, or the encoded arguments if deferred
+};
+
+/**
+ * log_ring
+ *  spsc_ring of log_entry whose slots live as long as the ring: a line is
+ *  copied into the string its slot already has, and copied out of it, so
+ *  the thread stops allocating once the slots have grown to its lines.
+ *  The lines, deferred or not, are kept to about MAX_ITEM_LENGTH, which
+ *  bounds what the slots hold.
+ */
+class log_ring {
+  public:
+    explicit log_ring(size_t volumn):
+      m_slots(round_up(volumn)),
+      m_mask(m_slots.size() - 1),
+      m_head(0),
+      m_tail(0),
+      m_head_cache(0) {
+    }
+    size_t capacity(void) const {
+        return m_mask + 1;
+    }
+    size_t size(void) const {
+        size_t head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+        return __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE) - head;
+    }
+    // producer side
+    bool try_put(const log_entry& entry) {
+        size_t tail = m_tail;
+        if (tail - m_head_cache > m_mask) {
+            m_head_cache = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+            if (tail - m_head_cache > m_mask) {
+                return false;
+            }
+        }
+        log_entry& slot = m_slots[tail & m_mask];
+        slot.stamp = entry.stamp;
+        slot.seq = entry.seq;
+        slot.when = entry.when;
+        slot.format = entry.format;
+        slot.tid = entry.tid;
+        slot.line.assign(entry.line.data(), entry.line.size());
+        __atomic_store_n(&m_tail, tail + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    // consumer side
+    template <typename OutputIterator>
+    size_t try_get(OutputIterator& oit, size_t n) {
+        size_t head = m_head;
+        size_t avail = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE) - head;
+        size_t i = 0;
+        try {
+            for (; i < n && i < avail; i++) {
+                *oit = m_slots[(head + i) & m_mask];
+                oit++;
+            }
+        } catch (...) {
+            __atomic_store_n(&m_head, head + i, __ATOMIC_RELEASE);
+            throw;
+        }
+        if (i > 0) {
+            __atomic_store_n(&m_head, head + i, __ATOMIC_RELEASE);
+        }
+        return i;
+    }
+
+  private:
+    static size_t round_up(size_t volumn) {
+        size_t n = 1;
+        while (n < volumn) n <<= 1;
+        return n;
+    }
+
+  private:
+    // non-copyable
+    log_ring(const log_ring&);
+    log_ring& operator=(const log_ring&);
+
+  private:
+    std::vector<log_entry> m_slots;
+    const size_t m_mask;
+
+    char m_pad0[XD_CACHELINE_SIZE];
+    size_t m_head;              // written by consumer
+
+    char m_pad1[XD_CACHELINE_SIZE - sizeof(size_t)];
+    size_t m_tail;              // written by producer
+    size_t m_head_cache;        // producer's copy of m_head
+
+    char m_pad2[XD_CACHELINE_SIZE - 2 * sizeof(size_t)];
+};
+
+/**
+ * log_buffer
+ *  One thread's lines for one log, put by the thread and taken by whoever
+ *  flushes, under the log's m_flush_mutex.
+ */
+struct log_buffer {
+    explicit log_buffer(size_t volumn):
+      ring(volumn), orphaned(false), seq(0), tid(0), overflow_epoch(0), second(-1) {
+    }
+    log_ring ring;
+    log_entry pending;          // the line being made, its capacity kept
+    bool orphaned;              // the thread has exited, free once drained
+    unsigned long seq;
+    unsigned tid;
+    unsigned long overflow_epoch;   // the log's m_epoch when it last fell back to m_cache
+
+    // the thread's cached line prefix
+    time_t second;
+    std::string time;           // second, formatted
+    std::string ids;            // ":app:pid:tid:"
+};
+
+}  // namespace internal
+
+/**
+ * log
+ *  A logging thread writes its lines into a lock-free buffer of its own,
+ *  and run() collects the buffers of all threads, merges them by time and
+ *  writes them out, so logging does not take a lock shared with the file
+ *  writes.  A thread whose buffer is half full wakes run() early; one
+ *  whose buffer is full falls back to m_cache under m_mutex, and wakes
+ *  run() past MAX_CACHE_SIZE.  A flush swaps m_cache for the empty
+ *  m_spare under m_mutex and writes m_spare out under m_flush_mutex only,
+ *  so that no logging thread waits on the file or writes it.
+ *
+ *  XD_LOG_DEFER logs without formatting on the calling thread: it stores
+ *  the id of its format string and the raw arguments, which run() formats
+ *  when it writes them out.  A log made with binary_flag writes them as
+ *  they are instead, to a .blog file which tools/binlog_decode turns into
+ *  the usual text, see binlog.h.  A log made with direct_flag writes its
+ *  files with O_DIRECT, see log_file.h.
+ *
+ *  XD_LOG is the type-safe form of error()..debug(): it checks its format
+ *  against the arguments at compile time, evaluates them only if the
+ *  level is on, and compiles out the levels above XD_LOG_MIN_LEVEL.
+ */
 class log: public IceUtil::Thread {
   public:
     static const unsigned MAX_FILE_SIZE = 1*512*1024*1024;      // 512M
     static const unsigned MAX_ITEM_LENGTH = 2 * 1024;           // 2K, as varchar2
+    static const unsigned GUESS_ITEM_LENGTH = 256;
     static const unsigned CHANGE_FILE_NAME_INTERVAL = 60 * 60;  // 1 hour
     static const unsigned MAX_CACHE_SIZE = 1024;
+    static const unsigned THREAD_BUFFER_SIZE = 4096;            // lines, per thread
     static const char* const DEFAULT_TIME_STRING_FORMAT;
     static const char DEFAULT_FIELD_SEPERATOR = ':';
     static const unsigned DEFAULT_FLUSH_INTERVAL = 5;          // in second
@@ -43,6 +205,11 @@ class log: public IceUtil::Thread {
         DEBUG,
         ALL,
     } level_type;
+    typedef enum {
+        SECONDS = 0,
+        MILLISECONDS,
+        MICROSECONDS
+    } precision_type;
 
   public:
     static const char* level2string(level_type level) {
@@ -78,32 +245,37 @@ class log: public IceUtil::Thread {
         const std::string& log_name,
         const std::string& app_name,
         level_type level = INFO,
-        bool print2screen_flag = false):
+        bool print2screen_flag = false,
+        bool binary_flag = false,
+        bool direct_flag = false):
       m_log_path(log_path),
       m_log_name(log_name),
       m_app_name(app_name),
       m_level(level),
       m_print2screen_flag(print2screen_flag),
-      m_loop_flag(1) {
-          time_t t = curtime();
-          m_last_log_name = next_log_name(t);
-          m_last_log_fos.open(m_last_log_name.c_str());
-          if (!m_last_log_fos.good()) {
-              throw std::runtime_error(_("open file error") + std::string(" -- ") + m_last_log_name);
+      m_binary_flag(binary_flag),
+      m_direct_flag(direct_flag),
+      m_epoch(1),
+      m_loop_flag(1),
+      m_precision(SECONDS),
+      m_render_second(-1) {
+          open_file(curtime());
+          int err = ::pthread_key_create(&m_buffer_key, &orphan);
+          if (err != 0) {
+              throw std::runtime_error(_("pthread_key_create error") + std::string(" -- ") + strerror(err));
           }
-          m_last_log_size = 0;
-          m_last_log_time = t;
       }
     ~log() {
         try {
             flush_cache();
+            m_last_log_file.close();
         }
         catch (...) {
             // NOTHING
         }
-        if (m_last_log_fos.is_open()) {
-            m_last_log_fos.close();
-            m_last_log_fos.clear();
+        ::pthread_key_delete(m_buffer_key);
+        for (size_t i = 0; i < m_buffers.size(); i++) {
+            delete m_buffers[i];
         }
     }
 #ifdef LOG_FUNCTION_SPECIFICATION
@@ -132,122 +304,471 @@ class log: public IceUtil::Thread {
         while (m_loop_flag) {
             try {
                 sleep();
-                IceUtil::Mutex::Lock lock(m_mutex);
                 flush_cache();
             }
             catch (const IceUtil::Exception& e) {
-                std::clog << compose(ERROR, "%s|%ld|%s", __func__, __LINE__, e.what()).second;
+                std::clog << compose(ERROR, "%s|%ld|%s", __func__, __LINE__, e.what());
             }
             catch (const std::exception& e) {
-                std::clog << compose(ERROR, "%s|%ld|%s", __func__, __LINE__, e.what()).second;
+                std::clog << compose(ERROR, "%s|%ld|%s", __func__, __LINE__, e.what());
             }
             catch (...) {
-                std::clog << compose(ERROR, "%s|%ld|%s", __func__, __LINE__, _("unknown exception")).second;
+                std::clog << compose(ERROR, "%s|%ld|%s", __func__, __LINE__, _("unknown exception"));
             }
         }
     }
     void stop(void) {
         m_loop_flag = 0;
+        m_forDrain.notify_all();
+    }
+    bool enabled(level_type level) const {
+        return level <= m_level;
     }
+#ifdef XD_HAVE_CXX11
+    /**
+     * a line of the format registered as id, see XD_LOG_DEFER.  Only the
+     * arguments are copied here, as binlog_encode() takes them, unless
+     * they take more than MAX_ITEM_LENGTH: those are formatted at once and
+     * cut like any line, so that no ring slot grows past a line.
+     */
+    template <typename... Args>
+    void defer(unsigned id, const Args&... args) {
+        internal::log_buffer* buffer = thread_buffer();
+        internal::log_entry& entry = buffer->pending;
+        entry.stamp = IceUtil::Time::now().toMicroSeconds();
+        entry.seq = buffer->seq++;
+        entry.when = static_cast<time_t>(entry.stamp / 1000000);
+        entry.format = id;
+        entry.tid = buffer->tid;
+        entry.line.clear();
+        binlog_encode_all(&entry.line, args...);
+        if (entry.line.size() > MAX_ITEM_LENGTH) {
+            render(buffer->ids, &buffer->second, &buffer->time, &entry);
+        }
+
+        if (m_print2screen_flag) {
+            internal::log_entry copy(entry);
+            render(buffer->ids, &buffer->second, &buffer->time, &copy);
+            std::clog << copy.line;
+        }
+
+        submit(buffer, entry);
+    }
+    /**
+     * a line at level, see XD_LOG, which checks format against the args.
+     */
+    template <typename... Args>
+    void print(level_type level, const char* format, const Args&... args) {
+        vprint(level, format, internal::log_arg(args)...);
+    }
+#endif
+    /**
+     * the fraction of a second put after the timestamp field's seconds,
+     * as ".mmm" or ".uuuuuu"; none by default.
+     */
+    void precision(precision_type p) {
+        __atomic_store_n(&m_precision, p, __ATOMIC_RELAXED);
+    }
+#ifdef XD_HAVE_COROUTINES
+    template <typename Executor>
+    class flush_awaitable {
+      public:
+        flush_awaitable(log* owner, Executor& ex): m_owner(owner), m_executor(&ex) {
+        }
+        bool await_ready(void) const noexcept {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            log* owner = m_owner;
+            std::exception_ptr* error = &m_error;
+            m_executor->post([owner, error, handle]() {
+                try {
+                    owner->flush_cache();
+                }
+                catch (...) {
+                    *error = std::current_exception();
+                }
+                handle.resume();
+            });
+        }
+        // rethrows what the flush threw
+        void await_resume(void) const {
+            if (m_error) {
+                std::rethrow_exception(m_error);
+            }
+        }
+
+      private:
+        log* m_owner;
+        Executor* m_executor;
+        std::exception_ptr m_error;
+    };
+    /**
+     * co_await lg.co_flush(ex) writes out the cache on one of ex's
+     * threads, where the coroutine then goes on, instead of blocking its
+     * own thread on the file.
+     */
+    template <typename Executor>
+    flush_awaitable<Executor> co_flush(Executor& ex) {
+        return flush_awaitable<Executor>(this, ex);
+    }
+#endif
 
   private:
+    void vprint(level_type level, const char* format, ...) {
+        va_list ap;
+        va_start(ap, format);
+        try {
+            record(level, format, ap);
+        }
+        catch (...) {
+            va_end(ap);
+            throw;
+        }
+        va_end(ap);
+    }
     void record(level_type level, const char* format, va_list ap) {
         if (level > m_level) {
             return;
         }
 
-        std::pair<time_t, std::string> item = vcompose(level, format, ap);
+        internal::log_buffer* buffer = thread_buffer();
+        internal::log_entry& entry = buffer->pending;
+        vcompose(buffer, level, format, ap, &entry);
 
         if (m_print2screen_flag) {
-            std::clog << item.second;
+            std::clog << entry.line;
         }
 
-        IceUtil::Mutex::Lock lock(m_mutex);
+        submit(buffer, entry);
 
-        m_cache.push_back(item);
+        return;
+    }
+    /**
+     * a copy of the thread's pending entry into its buffer, or into
+     * m_cache if the writer is behind.  Once in m_cache, the thread's
+     * lines stay there until the next flush takes it, so that none of
+     * them is written before an earlier one.
+     */
+    void submit(internal::log_buffer* buffer, internal::log_entry& entry) {
+        if (buffer->overflow_epoch != __atomic_load_n(&m_epoch, __ATOMIC_ACQUIRE) &&
+            buffer->ring.try_put(entry)) {
+            if (buffer->ring.size() >= THREAD_BUFFER_SIZE / 2) {
+                m_forDrain.notify(1);
+            }
+            return;
+        }
 
-        if (m_cache.size() > MAX_CACHE_SIZE) {
-            flush_cache();
+        if (entry.format != 0 && !m_binary_flag) {
+            render(buffer->ids, &buffer->second, &buffer->time, &entry);
         }
 
-        return;
+        bool wake;
+        {
+            IceUtil::Mutex::Lock lock(m_mutex);
+            if (buffer->overflow_epoch != m_epoch && buffer->ring.try_put(entry)) {
+                return;
+            }
+            buffer->overflow_epoch = m_epoch;
+            m_cache.push_back(entry);
+            wake = m_cache.size() > MAX_CACHE_SIZE;
+        }
+        if (wake) {
+            m_forDrain.notify(1);
+        }
+    }
+    // the calling thread's buffer, made on its first line
+    internal::log_buffer* thread_buffer(void) {
+        internal::log_buffer* buffer = static_cast<internal::log_buffer*>(::pthread_getspecific(m_buffer_key));
+        if (buffer == 0) {
+            buffer = new internal::log_buffer(THREAD_BUFFER_SIZE);
+            static unsigned pid = ::getpid();
+            unsigned tid = ::pthread_self();
+            buffer->tid = tid;
+            buffer->ids = DEFAULT_FIELD_SEPERATOR + m_app_name
+                        + DEFAULT_FIELD_SEPERATOR + to_string(pid)
+                        + DEFAULT_FIELD_SEPERATOR + to_string(tid)
+                        + DEFAULT_FIELD_SEPERATOR;
+            {
+                IceUtil::Mutex::Lock lock(m_buffers_mutex);
+                m_buffers.push_back(buffer);
+            }
+            ::pthread_setspecific(m_buffer_key, buffer);
+        }
+        return buffer;
+    }
+    static void orphan(void* buffer) {
+        __atomic_store_n(&static_cast<internal::log_buffer*>(buffer)->orphaned, true, __ATOMIC_RELEASE);
     }
-    std::pair<time_t, std::string> compose(level_type level, const char* format, ...) {
+    static bool earlier(const internal::log_entry& a, const internal::log_entry& b) {
+        return a.stamp < b.stamp || (a.stamp == b.stamp && a.seq < b.seq);
+    }
+    /**
+     * move every thread's lines into m_spare, in time order, m_flush_mutex
+     * held.
+     */
+    void drain(void) {
+        IceUtil::Mutex::Lock lock(m_buffers_mutex);
+        size_t before = m_spare.size();
+        for (size_t i = 0; i < m_buffers.size();) {
+            internal::log_buffer* buffer = m_buffers[i];
+            // before taking, so that the last lines are not left behind
+            bool orphaned = __atomic_load_n(&buffer->orphaned, __ATOMIC_ACQUIRE);
+            std::back_insert_iterator<std::vector<internal::log_entry> > oit(m_spare);
+            size_t mark = m_spare.size();
+            buffer->ring.try_get(oit, buffer->ring.capacity());
+            for (size_t j = mark; j < m_spare.size() && !m_binary_flag; j++) {
+                if (m_spare[j].format != 0) {
+                    render(buffer->ids, &m_render_second, &m_render_time, &m_spare[j]);
+                }
+            }
+            if (orphaned) {
+                delete buffer;
+                m_buffers[i] = m_buffers.back();
+                m_buffers.pop_back();
+            }
+            else {
+                i++;
+            }
+        }
+        if (m_spare.size() > before) {
+            std::stable_sort(m_spare.begin(), m_spare.end(), earlier);
+        }
+    }
+    std::string compose(level_type level, const char* format, ...) {
         va_list ap;
         va_start(ap, format);
-        std::pair<time_t, std::string> item;
+        internal::log_entry entry;
         try {
-            item = vcompose(level, format, ap);
+            vcompose(thread_buffer(), level, format, ap, &entry);
         }
         catch (...) {
             va_end(ap);
             throw;
         }
         va_end(ap);
-        return item;
+        return entry.line;
     }
-    std::pair<time_t, std::string> vcompose(level_type level, const char* format, va_list ap) {
-        size_t len;
-        char item_buffer[MAX_ITEM_LENGTH] = {'\0'};
-        len = static_cast<size_t>(vsnprintf(item_buffer, MAX_ITEM_LENGTH, format, ap));
-        if (len >= MAX_ITEM_LENGTH) {
-            item_buffer[MAX_ITEM_LENGTH - 1] = '\0';
-            len = MAX_ITEM_LENGTH - 1;
+    /**
+     * "time:app:pid:tid:LEVEL:message\n" into entry without iostreams: the
+     * formatted second and the ":app:pid:tid:" come from the thread's
+     * buffer, the former refreshed when the second changes, and the
+     * message is printed in place, truncated to MAX_ITEM_LENGTH - 1, into
+     * the capacity entry's line already has.
+     */
+    void vcompose(internal::log_buffer* buffer, level_type level, const char* format, va_list ap,
+                  internal::log_entry* entry) {
+        entry->stamp = IceUtil::Time::now().toMicroSeconds();
+        entry->seq = buffer->seq++;
+        entry->when = static_cast<time_t>(entry->stamp / 1000000);
+        entry->format = 0;
+        entry->tid = buffer->tid;
+        if (entry->when != buffer->second) {
+            buffer->time = time2string(entry->when, DEFAULT_TIME_STRING_FORMAT);
+            buffer->second = entry->when;
         }
 
-        time_t now = curtime();
-        std::ostringstream sos;
-
-        static unsigned pid = ::getpid();
-        unsigned tid = ::pthread_self();
+        std::string& line = entry->line;
+        line.reserve(buffer->time.size() + buffer->ids.size() + GUESS_ITEM_LENGTH + 16);
+        line = buffer->time;
+        append_fraction(&line, static_cast<unsigned>(entry->stamp % 1000000));
+        line += buffer->ids;
+        line += level2string(level);
+        line += DEFAULT_FIELD_SEPERATOR;
 
-        sos << time2string(now, DEFAULT_TIME_STRING_FORMAT)
-            << DEFAULT_FIELD_SEPERATOR
-            << m_app_name
-            << DEFAULT_FIELD_SEPERATOR
-            << pid
-            << DEFAULT_FIELD_SEPERATOR
-            << tid
-            << DEFAULT_FIELD_SEPERATOR
-            << level2string(level)
-            << DEFAULT_FIELD_SEPERATOR
-            << item_buffer
-            << std::endl;
-
-        return std::make_pair<time_t, std::string>(now, sos.str());
+        // most messages fit the first guess, the rest are printed twice
+        size_t at = line.size();
+        va_list again;
+#ifdef va_copy
+        va_copy(again, ap);
+#else
+        // strict C++98 has only the GNU spelling
+        __va_copy(again, ap);
+#endif
+        line.resize(at + GUESS_ITEM_LENGTH);
+        int len = vsnprintf(&line[at], GUESS_ITEM_LENGTH, format, ap);
+        if (len >= static_cast<int>(GUESS_ITEM_LENGTH)) {
+            size_t room = std::min(static_cast<size_t>(len) + 1, static_cast<size_t>(MAX_ITEM_LENGTH));
+            line.resize(at + room);
+            len = vsnprintf(&line[at], room, format, again);
+        }
+        va_end(again);
+        size_t n = len < 0 ? 0 : std::min(static_cast<size_t>(len), static_cast<size_t>(MAX_ITEM_LENGTH - 1));
+        line.resize(at + n);
+        line += '\n';
+    }
+    /**
+     * a deferred entry into its text line, as vcompose() would have made
+     * it, with the caller's formatted second.
+     */
+    void render(const std::string& ids, time_t* second, std::string* time, internal::log_entry* entry) {
+        if (entry->when != *second) {
+            *time = time2string(entry->when, DEFAULT_TIME_STRING_FORMAT);
+            *second = entry->when;
+        }
+        std::string line(*time);
+        append_fraction(&line, static_cast<unsigned>(entry->stamp % 1000000));
+        line += ids;
+        const binlog_formats::format* f = binlog_formats::find(entry->format);
+        line += f != 0 ? f->level.c_str() : "?";
+        line += DEFAULT_FIELD_SEPERATOR;
+        size_t at = line.size();
+        if (f == 0) {
+            line += _("unknown deferred format");
+        }
+        else if (!binlog_render(f->text, entry->line.data(), entry->line.size(), &line)) {
+            line += _(" -- corrupt deferred arguments");
+        }
+        if (line.size() - at > MAX_ITEM_LENGTH - 1) {
+            line.resize(at + MAX_ITEM_LENGTH - 1);
+        }
+        line += '\n';
+        entry->line.swap(line);
+        entry->format = 0;
     }
+    void append_fraction(std::string* line, unsigned usecs) const {
+        precision_type precision = __atomic_load_n(&m_precision, __ATOMIC_RELAXED);
+        if (precision == SECONDS) {
+            return;
+        }
+        int width = (precision == MILLISECONDS ? 3 : 6);
+        unsigned v = (precision == MILLISECONDS ? usecs / 1000 : usecs);
+        char digits[8] = {'.'};
+        for (int i = width; i > 0; i--) {
+            digits[i] = static_cast<char>('0' + v % 10);
+            v /= 10;
+        }
+        line->append(digits, width + 1);
+    }
+    // FLUSH_INTERVAL, or until a buffer fills up
     void sleep(void) {
-        getThreadControl().sleep(IceUtil::Time::seconds(static_cast<IceUtil::Int64>(FLUSH_INTERVAL)));
+        deadline until(static_cast<unsigned>(FLUSH_INTERVAL) * 1000000u);
+        int ticket = m_forDrain.prepare_wait();
+        if (!m_loop_flag) {
+            m_forDrain.cancel_wait();
+            return;
+        }
+        m_forDrain.wait(ticket, wait_policy(), &until);
     }
     void flush_cache(void) {
-        size_t cache_size = m_cache.size();
-        for (size_t i = 0; i < cache_size; i++) {
-            const time_t& current = m_cache[i].first;
-            const std::string& item = m_cache[i].second;
-            if (current >= m_last_log_time + CHANGE_FILE_NAME_INTERVAL ||
-                m_last_log_size + item.size() > MAX_FILE_SIZE) {
-                m_last_log_fos.close();
-                m_last_log_fos.clear();
-                m_last_log_name = next_log_name(current);
-                m_last_log_fos.open(m_last_log_name.c_str());
-                if (!m_last_log_fos.good()) {
-                    throw std::runtime_error(_("open file error") + std::string(" -- ") + m_last_log_name);
-                }
-                m_last_log_size = 0;
-                m_last_log_time = current;
+        IceUtil::Mutex::Lock lock(m_flush_mutex);
+        {
+            IceUtil::Mutex::Lock lock(m_mutex);
+            if (m_spare.empty()) {
+                m_cache.swap(m_spare);
+            }
+            else {
+                // the last write failed, keep its lines first
+                m_spare.insert(m_spare.end(), m_cache.begin(), m_cache.end());
+                m_cache.clear();
             }
-            m_last_log_fos << item;
-            if (!m_last_log_fos.good()) {
-                throw std::runtime_error(_("write file error") + std::string(" -- ") + m_last_log_name);
+            __atomic_store_n(&m_epoch, m_epoch + 1, __ATOMIC_RELEASE);
+        }
+        drain();
+        // the lines, or the records gathered in m_batch, go out in one write
+        size_t cache_size = m_spare.size();
+        size_t written = 0;     // lines the file has taken, not to be retried
+        try {
+            for (size_t i = 0; i < cache_size; i++) {
+                const time_t& current = m_spare[i].when;
+                // a new file by time or size, or in place of one whose close failed
+                if (current >= m_last_log_time + CHANGE_FILE_NAME_INTERVAL ||
+                    m_last_log_size + m_spare[i].line.size() > MAX_FILE_SIZE ||
+                    !m_last_log_file.is_open()) {
+                    write_batch(&written, i);
+                    m_last_log_file.close();
+                    open_file(current);
+                }
+                if (m_binary_flag) {
+                    size_t before = m_batch.size();
+                    encode(m_spare[i], &m_batch);
+                    m_last_log_size += m_batch.size() - before;
+                }
+                else {
+                    m_last_log_file.append(m_spare[i].line);
+                    m_last_log_size += m_spare[i].line.size();
+                }
             }
-            m_last_log_size += item.size();
+            write_batch(&written, cache_size);
         }
-        m_cache.clear();
-        if (m_last_log_fos.good()) {
-            m_last_log_fos.flush();
+        catch (...) {
+            // the rest stays in m_spare, its formats are defined again
+            m_last_log_file.discard();
+            m_batch.clear();
+            m_defined.clear();
+            m_spare.erase(m_spare.begin(), m_spare.begin() + written);
+            throw;
         }
+        m_spare.clear();
         return;
     }
+    /**
+     * commits the lines before upto, with m_batch; once commit() is called
+     * they are the file's, written or kept, even if it throws.
+     */
+    void write_batch(size_t* written, size_t upto) {
+        m_last_log_file.append(m_batch);
+        *written = upto;
+        m_last_log_file.commit();
+        m_batch.clear();
+    }
+    void open_file(const time_t& t) {
+        m_last_log_name = next_log_name(t);
+        m_last_log_file.open(m_last_log_name, MAX_FILE_SIZE, m_direct_flag);
+        m_last_log_size = 0;
+        m_last_log_time = t;
+        if (m_binary_flag) {
+            m_defined.clear();
+            internal::binlog_begin(&m_scratch, 'H');
+            m_scratch += m_app_name;
+            m_scratch += '\0';
+            m_scratch += DEFAULT_TIME_STRING_FORMAT;
+            m_scratch += '\0';
+            m_scratch += DEFAULT_FIELD_SEPERATOR;
+            internal::binlog_raw(&m_scratch, static_cast<uint32_t>(::getpid()));
+            internal::binlog_end(&m_scratch);
+            m_batch += m_scratch;
+            m_last_log_size += m_scratch.size();
+        }
+    }
+    /**
+     * the binary file records of an entry onto *out, its format's first,
+     * see binlog.h.
+     */
+    void encode(const internal::log_entry& entry, std::string* out) {
+        if (entry.format == 0) {
+            internal::binlog_begin(&m_scratch, 'T');
+            m_scratch += entry.line;
+            internal::binlog_end(&m_scratch);
+            *out += m_scratch;
+            return;
+        }
+        if (entry.format >= m_defined.size() || !m_defined[entry.format]) {
+            const binlog_formats::format* f = binlog_formats::find(entry.format);
+            internal::binlog_begin(&m_scratch, 'F');
+            internal::binlog_raw(&m_scratch, static_cast<uint32_t>(entry.format));
+            if (f != 0) {
+                m_scratch += f->level;
+            }
+            m_scratch += '\0';
+            if (f != 0) {
+                m_scratch += f->text;
+            }
+            internal::binlog_end(&m_scratch);
+            *out += m_scratch;
+            if (entry.format >= m_defined.size()) {
+                m_defined.resize(entry.format + 1, false);
+            }
+            m_defined[entry.format] = true;
+        }
+        internal::binlog_begin(&m_scratch, 'E');
+        internal::binlog_raw(&m_scratch, static_cast<uint32_t>(entry.format));
+        internal::binlog_raw(&m_scratch, static_cast<int64_t>(entry.stamp));
+        internal::binlog_raw(&m_scratch, static_cast<uint32_t>(entry.tid));
+        m_scratch += entry.line;
+        internal::binlog_end(&m_scratch);
+        *out += m_scratch;
+    }
     std::string next_log_name(const time_t& t) {
         std::ostringstream sos;
         sos << m_log_path 
@@ -257,7 +778,7 @@ class log: public IceUtil::Thread {
             << m_app_name
             << '_'
             << time2string(t, DEFAULT_TIME_STRING_FORMAT)
-            << ".log";
+            << (m_binary_flag ? ".blog" : ".log");
         return sos.str();
     }
 
@@ -266,17 +787,82 @@ class log: public IceUtil::Thread {
     std::string m_log_name;
     std::string m_app_name;
     level_type m_level;
-    std::ofstream   m_last_log_fos;
+    log_file        m_last_log_file;
     std::string     m_last_log_name;
     size_t          m_last_log_size;
     time_t          m_last_log_time;
     bool m_print2screen_flag;
-    std::vector<std::pair<time_t, std::string> > m_cache;
+    bool m_binary_flag;
+    bool m_direct_flag;
+    std::vector<internal::log_entry> m_cache;
     IceUtil::Mutex m_mutex;
+    unsigned long m_epoch;          // flushes so far, under m_mutex
     volatile int m_loop_flag;
+
+    pthread_key_t m_buffer_key;
+    std::vector<internal::log_buffer*> m_buffers;
+    IceUtil::Mutex m_buffers_mutex;
+    waitqueue m_forDrain;
+    precision_type m_precision;
+
+    // the writer's, under m_flush_mutex
+    IceUtil::Mutex m_flush_mutex;
+    std::vector<internal::log_entry> m_spare;
+    time_t m_render_second;
+    std::string m_render_time;
+    std::vector<bool> m_defined;    // format ids with a record in the file
+    std::string m_batch;
+    std::string m_scratch;
 };
 
 }      // namespace util
 }      // namespace xd
 
+/**
+ * XD_LOG_MIN_LEVEL
+ *  The most verbose level compiled in, ALL by default: XD_LOG and
+ *  XD_LOG_DEFER calls above it are still checked, but generate no code.
+ *  Define it, e.g. to INFO, before including log.h.
+ */
+#ifndef XD_LOG_MIN_LEVEL
+#   define XD_LOG_MIN_LEVEL ALL
+#endif
+
+#define XD_LOG_ON(lg, level)                                                            \
+    (xd::util::log::level <= xd::util::log::XD_LOG_MIN_LEVEL &&                         \
+     (lg).enabled(xd::util::log::level))
+
+/**
+ * XD_LOG(lg, level, format, ...)
+ *  lg.print(level, format, ...): level is ERROR, WARN, INFO or DEBUG and
+ *  format a literal, checked against the arguments at compile time, see
+ *  log_format.h; std::string arguments print as %s.  Nothing is evaluated
+ *  below lg's level.  Needs XD_HAVE_CXX11.
+ */
+#define XD_LOG(lg, level, format, ...)                                                  \
+    do {                                                                                \
+        XD_LOG_FORMAT_CHECK(format, ##__VA_ARGS__);                                     \
+        if (XD_LOG_ON(lg, level)) {                                                     \
+            (lg).print(xd::util::log::level, format, ##__VA_ARGS__);                    \
+        }                                                                               \
+    } while (0)
+
+/**
+ * XD_LOG_DEFER(lg, level, format, ...)
+ *  XD_LOG for the hot paths: format is registered once per call site, and
+ *  the call copies the raw arguments and leaves the formatting to the
+ *  writer, so C strings are copied whole.  Needs XD_HAVE_CXX11.
+ */
+#define XD_LOG_DEFER(lg, level, format, ...)                                            \
+    do {                                                                                \
+        XD_LOG_FORMAT_CHECK(format, ##__VA_ARGS__);                                     \
+        static_assert(sizeof(format) <= xd::util::internal::BINLOG_MAX_FORMAT,          \
+                      "XD_LOG_DEFER format too long for a binlog record");              \
+        if (XD_LOG_ON(lg, level)) {                                                     \
+            static const unsigned xd_log_format_id = xd::util::binlog_formats::add(     \
+                xd::util::log::level2string(xd::util::log::level), format);             \
+            (lg).defer(xd_log_format_id, ##__VA_ARGS__);                                \
+        }                                                                               \
+    } while (0)
+
 #endif  // !__XD_UTIL_LOG_H__
@@ -0,0 +1,305 @@
+#ifndef __XD_UTIL_LOG_FILE_H__
+#define __XD_UTIL_LOG_FILE_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <xd/topdef.h>
+
+namespace xd { namespace util {
+
+/**
+ * log_file
+ *  The file a log writes to.  append() gathers the lines of a flush, which
+ *  must stay put until commit() writes them with as few pwritev calls as
+ *  IOV_MAX allows.  A commit() which fails keeps what it did not write and
+ *  writes it first the next time, so the caller sends nothing twice.
+ *
+ *  The file is preallocated with fallocate, keeping its size, so that
+ *  writes do not stall on extent allocation, and close() gives back what
+ *  was not used.  Its dirty pages are bounded: past SYNC_BYTES, the
+ *  writeback of the new range is started and that of the one before
+ *  waited for, with sync_file_range.
+ *
+ *  In direct mode, where the file system takes O_DIRECT, the lines are
+ *  copied into a page-aligned buffer and written in whole blocks instead,
+ *  bypassing the page cache; the last block is padded with zeros until
+ *  close() cuts the file back to its size.
+ */
+class log_file {
+  public:
+    static const size_t DIRECT_ALIGNMENT = 4096;
+    static const size_t DIRECT_BUFFER_SIZE = 1024 * 1024;
+    static const off_t SYNC_BYTES = 8 * 1024 * 1024;
+
+  public:
+    log_file(): m_fd(-1), m_direct(false), m_offset(0), m_synced(0), m_waited(0),
+                m_buffer(0), m_used(0), m_kept(0) {
+    }
+    ~log_file() {
+        try {
+            close();
+        }
+        catch (...) {
+            // NOTHING
+        }
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+        free(m_buffer);
+    }
+    /**
+     * truncates or creates path, preallocating preallocate bytes.
+     */
+    void open(const std::string& path, size_t preallocate, bool direct = false) {
+        close();
+        if (direct) {
+            m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT | O_CLOEXEC, 0644);
+            if (m_fd < 0 && errno != EINVAL) {
+                fail(_("open file error"), path);
+            }
+        }
+        m_direct = m_fd >= 0;
+        if (m_fd < 0) {
+            m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (m_fd < 0) {
+                fail(_("open file error"), path);
+            }
+        }
+        m_path = path;
+        m_offset = m_synced = m_waited = 0;
+        m_used = m_kept = 0;
+        m_pending.clear();
+        if (m_direct && m_buffer == 0) {
+            void* p = 0;
+            if (posix_memalign(&p, DIRECT_ALIGNMENT, DIRECT_BUFFER_SIZE) != 0) {
+                ::close(m_fd);
+                m_fd = -1;
+                throw std::runtime_error(_("not enough memory"));
+            }
+            m_buffer = static_cast<char*>(p);
+        }
+        // best effort, not every file system has it
+        ::fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, preallocate);
+    }
+    bool is_open(void) const {
+        return m_fd >= 0;
+    }
+    /**
+     * in direct mode, the part which fits is copied into the buffer at
+     * once; the rest, and the text mode lines, are written by commit().
+     */
+    void append(const std::string& item) {
+        if (item.empty()) {
+            return;
+        }
+        size_t done = 0;
+        if (m_direct && m_iov.empty() && m_pending.empty()) {
+            done = std::min(item.size(), DIRECT_BUFFER_SIZE - m_used);
+            memcpy(m_buffer + m_used, item.data(), done);
+            m_used += done;
+        }
+        if (done < item.size()) {
+            struct iovec iov;
+            iov.iov_base = const_cast<char*>(item.data() + done);
+            iov.iov_len = item.size() - done;
+            m_iov.push_back(iov);
+        }
+    }
+    // drops what was appended since the last commit()
+    void discard(void) {
+        m_iov.clear();
+        m_used = m_kept;
+    }
+    /**
+     * writes what was appended.  What it takes is the file's even if it
+     * throws: the bytes it could not write are kept and written first by
+     * the next commit(), so they must not be appended again.
+     */
+    void commit(void) {
+        if (m_fd < 0) {
+            bool pending = !m_iov.empty() || !m_pending.empty() || m_used > 0;
+            m_iov.clear();
+            m_pending.clear();
+            m_used = m_kept = 0;
+            if (pending) {
+                throw std::runtime_error(_("write file error") + std::string(" -- ") + m_path +
+                                         " -- " + _("not open"));
+            }
+            return;
+        }
+        std::vector<struct iovec> iov;
+        if (!m_pending.empty()) {
+            struct iovec pending;
+            pending.iov_base = &m_pending[0];
+            pending.iov_len = m_pending.size();
+            iov.push_back(pending);
+        }
+        iov.insert(iov.end(), m_iov.begin(), m_iov.end());
+        m_iov.clear();
+        size_t i = 0;
+        try {
+            if (m_direct) {
+                commit_direct(&iov, &i);
+            }
+            else {
+                commit_vector(&iov, &i);
+            }
+        }
+        catch (...) {
+            keep(iov, i);
+            throw;
+        }
+        m_pending.clear();
+        bound_dirty();
+    }
+    // cuts the file to its size, past the padding and the preallocation
+    void close(void) {
+        if (m_fd < 0) {
+            m_iov.clear();
+            return;
+        }
+        discard();
+        commit();
+        int fd = m_fd;
+        off_t size = m_offset + m_used;
+        m_fd = -1;
+        m_used = m_kept = 0;
+        if (::ftruncate(fd, size) != 0) {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            fail(_("write file error"), m_path);
+        }
+        ::close(fd);
+    }
+
+  private:
+    /**
+     * iov with pwritev, advancing *i and cutting the iovec partly written,
+     * so that a failure leaves what is left in iov[*i, end).
+     */
+    void commit_vector(std::vector<struct iovec>* iov, size_t* i) {
+        while (*i < iov->size()) {
+            int n = static_cast<int>(std::min(iov->size() - *i, static_cast<size_t>(IOV_MAX)));
+            ssize_t written = ::pwritev(m_fd, &(*iov)[*i], n, m_offset);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fail(_("write file error"), m_path);
+            }
+            m_offset += written;
+            *i = skip(iov, *i, written);
+        }
+    }
+    /**
+     * the buffer, then iov copied through it, as commit_vector().  A
+     * failed write leaves the buffer as it was, to be written again over
+     * the same range.
+     */
+    void commit_direct(std::vector<struct iovec>* iov, size_t* i) {
+        for (;;) {
+            while (*i < iov->size() && m_used < DIRECT_BUFFER_SIZE) {
+                size_t n = std::min((*iov)[*i].iov_len, DIRECT_BUFFER_SIZE - m_used);
+                memcpy(m_buffer + m_used, (*iov)[*i].iov_base, n);
+                m_used += n;
+                *i = skip(iov, *i, n);
+            }
+            m_kept = m_used;
+            write_direct();
+            m_kept = m_used;
+            if (*i == iov->size()) {
+                return;
+            }
+        }
+    }
+    // past n bytes of iov from i, the partly passed iovec cut
+    static size_t skip(std::vector<struct iovec>* iov, size_t i, size_t n) {
+        for (; i < iov->size() && n >= (*iov)[i].iov_len; i++) {
+            n -= (*iov)[i].iov_len;
+        }
+        if (n > 0) {
+            (*iov)[i].iov_base = static_cast<char*>((*iov)[i].iov_base) + n;
+            (*iov)[i].iov_len -= n;
+        }
+        return i;
+    }
+    // copies what a failed commit left of iov, from i, into m_pending
+    void keep(const std::vector<struct iovec>& iov, size_t i) {
+        std::string left;
+        for (size_t j = i; j < iov.size(); j++) {
+            left.append(static_cast<const char*>(iov[j].iov_base), iov[j].iov_len);
+        }
+        m_pending.swap(left);
+    }
+    /**
+     * the buffer from its aligned offset, rounded up to whole blocks; the
+     * partial last block is kept and written again with what follows.
+     */
+    void write_direct(void) {
+        size_t rounded = (m_used + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+        memset(m_buffer + m_used, 0, rounded - m_used);
+        for (size_t done = 0; done < rounded;) {
+            ssize_t written = ::pwrite(m_fd, m_buffer + done, rounded - done, m_offset + done);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fail(_("write file error"), m_path);
+            }
+            done += written;
+        }
+        size_t whole = m_used / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+        memmove(m_buffer, m_buffer + whole, m_used - whole);
+        m_offset += whole;
+        m_used -= whole;
+    }
+    void bound_dirty(void) {
+        if (m_offset - m_synced < SYNC_BYTES) {
+            return;
+        }
+        if (m_synced > m_waited) {
+            ::sync_file_range(m_fd, m_waited, m_synced - m_waited,
+                              SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+        ::sync_file_range(m_fd, m_synced, m_offset - m_synced, SYNC_FILE_RANGE_WRITE);
+        m_waited = m_synced;
+        m_synced = m_offset;
+    }
+    static void fail(const char* what, const std::string& path) {
+        throw std::runtime_error(what + std::string(" -- ") + path + " -- " + strerror(errno));
+    }
+
+  private:
+    log_file(const log_file&);
+    log_file& operator=(const log_file&);
+
+  private:
+    int m_fd;
+    std::string m_path;
+    bool m_direct;
+    off_t m_offset;             // where the next write goes, aligned in direct mode
+    off_t m_synced;             // writeback started up to here
+    off_t m_waited;             // and waited for up to here
+    std::vector<struct iovec> m_iov;
+    char* m_buffer;             // direct mode's, page-aligned
+    size_t m_used;
+    size_t m_kept;              // of m_used, what the last commit() took
+    std::string m_pending;      // what a failed commit() could not write
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_LOG_FILE_H__
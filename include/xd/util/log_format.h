@@ -0,0 +1,193 @@
+#ifndef __XD_UTIL_LOG_FORMAT_H__
+#define __XD_UTIL_LOG_FORMAT_H__
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+
+#include <xd/topdef.h>
+
+#ifdef XD_HAVE_CXX11
+
+#include <tuple>
+#include <type_traits>
+
+namespace xd { namespace util {
+
+namespace internal {
+
+/**
+ * log_check<Args...>::ok(format, false)
+ *  Whether a printf format takes exactly Args, as printf would read them:
+ *  every conversion, and every '*' width or precision, against the next
+ *  argument, its length modifier against the argument's size.  It is
+ *  constexpr, so XD_LOG checks its literal at compile time.
+ *
+ *  An argument is one of
+ *      'i' the integers, bool and the enums, at least as wide as int
+ *      'f' float and double, 'F' long double
+ *      's' char*, const char* and std::string, printed by c_str()
+ *      'p' any other pointer
+ *  coded as its letter * 100 + its size as printf reads it.  '%n' and the
+ *  wide characters are not taken.
+ */
+template <typename T>
+struct log_kind {
+    typedef typename std::remove_cv<typename std::decay<T>::type>::type type;
+    static constexpr int value =
+        std::is_same<type, char*>::value || std::is_same<type, const char*>::value ||
+            std::is_same<type, std::string>::value ? 's' * 100 :
+        std::is_integral<type>::value || std::is_enum<type>::value ?
+            'i' * 100 + static_cast<int>(sizeof(type) < sizeof(int) ? sizeof(int) : sizeof(type)) :
+        std::is_same<type, long double>::value ? 'F' * 100 :
+        std::is_floating_point<type>::value ? 'f' * 100 :
+        std::is_pointer<type>::value || std::is_same<type, std::nullptr_t>::value ? 'p' * 100 :
+        0;
+};
+
+constexpr bool log_in(char c, const char* set) {
+    return *set != '\0' && (c == *set || log_in(c, set + 1));
+}
+
+// from within a spec, the next '*' or the conversion
+constexpr const char* log_in_spec(const char* p) {
+    return *p != '\0' && log_in(*p, "-+ #0'123456789.hlLqjzt") ? log_in_spec(p + 1) : p;
+}
+
+#if defined(__cpp_constexpr) && __cpp_constexpr >= 201304
+// the first '%' or '\0' from f
+constexpr const char* log_find(const char* f) {
+    while (*f != '\0' && *f != '%') {
+        f++;
+    }
+    return f;
+}
+#else
+/**
+ * the first '%' or '\0' in f[0, n), f + n if none, halving the range so
+ * that a long literal does not nest a call per character; the right half
+ * is read only if the left one has no '\0'.
+ */
+constexpr const char* log_scan(const char* f, size_t n);
+
+constexpr const char* log_scan_right(const char* left, const char* mid, size_t n) {
+    return left != mid ? left : log_scan(mid, n);
+}
+constexpr const char* log_scan(const char* f, size_t n) {
+    return n == 1 ? (*f == '\0' || *f == '%' ? f : f + 1) :
+        log_scan_right(log_scan(f, n / 2), f + n / 2, n - n / 2);
+}
+// the first '%' or '\0' from f, in ranges of doubling length
+constexpr const char* log_find(const char* f, size_t n = 1);
+
+constexpr const char* log_find_next(const char* p, const char* end, size_t n) {
+    return p != end ? p : log_find(end, 2 * n);
+}
+constexpr const char* log_find(const char* f, size_t n) {
+    return log_find_next(log_scan(f, n), f + n, n);
+}
+#endif
+
+constexpr const char* log_next_spec(const char* f);
+
+// from the '%' or '\0' at p, as log_next_spec()
+constexpr const char* log_at_spec(const char* p) {
+    return *p == '\0' ? p :
+        p[1] == '%' ? log_next_spec(p + 2) :
+        log_in_spec(p + 1);
+}
+// the first '*' or conversion of the next spec, or the terminating '\0'
+constexpr const char* log_next_spec(const char* f) {
+    return log_at_spec(log_find(f));
+}
+
+// what the integer conversion at p reads, by the modifier before it
+constexpr int log_integer(const char* p) {
+    return 'i' * 100 + static_cast<int>(
+        p[-1] == 'l' && p[-2] == 'l' ? sizeof(long long) :
+        p[-1] == 'l' ? sizeof(long) :
+        p[-1] == 'q' ? sizeof(long long) :
+        p[-1] == 'j' ? sizeof(intmax_t) :
+        p[-1] == 'z' ? sizeof(size_t) :
+        p[-1] == 't' ? sizeof(ptrdiff_t) :
+        sizeof(int));
+}
+
+// what the '*' or conversion at p reads, 0 if it is not taken
+constexpr int log_expect(const char* p) {
+    return *p == '*' ? 'i' * 100 + static_cast<int>(sizeof(int)) :
+        log_in(*p, "diouxX") ? log_integer(p) :
+        *p == 'c' ? (p[-1] == 'l' ? 0 : 'i' * 100 + static_cast<int>(sizeof(int))) :
+        log_in(*p, "eEfFgGaA") ? (p[-1] == 'L' ? 'F' * 100 : 'f' * 100) :
+        *p == 's' ? (p[-1] == 'l' ? 0 : 's' * 100) :
+        *p == 'p' ? 'p' * 100 :
+        0;
+}
+
+constexpr bool log_fits(int kind, int expect) {
+    return expect != 0 && (kind == expect || (expect == 'p' * 100 && kind == 's' * 100));
+}
+
+template <typename... Args>
+struct log_check;
+
+template <>
+struct log_check<> {
+    // inside: f is within a spec whose '*' took the last argument
+    static constexpr bool ok(const char* f, bool inside) {
+        return !inside && *log_next_spec(f) == '\0';
+    }
+};
+
+template <typename Arg, typename... Args>
+struct log_check<Arg, Args...> {
+    static constexpr bool ok(const char* f, bool inside) {
+        return step(inside ? log_in_spec(f) : log_next_spec(f));
+    }
+    static constexpr bool step(const char* p) {
+        return *p != '\0' &&
+            log_fits(log_kind<Arg>::value, log_expect(p)) &&
+            log_check<Args...>::ok(p + 1, *p == '*');
+    }
+};
+
+template <typename Tuple>
+struct log_check_tuple;
+
+template <typename... Args>
+struct log_check_tuple<std::tuple<Args...> >: log_check<Args...> {
+};
+
+// an argument as printf takes it, an enum as its underlying type
+template <typename T>
+inline typename std::enable_if<!std::is_enum<T>::value, const T&>::type log_arg(const T& v) {
+    return v;
+}
+template <typename T>
+inline typename std::enable_if<std::is_enum<T>::value, typename std::underlying_type<T>::type>::type
+log_arg(const T& v) {
+    return static_cast<typename std::underlying_type<T>::type>(v);
+}
+inline const char* log_arg(const std::string& s) {
+    return s.c_str();
+}
+
+}  // namespace internal
+
+} // namespace util
+} // namespace xd
+
+/**
+ * XD_LOG_FORMAT_CHECK(format, ...)
+ *  static_asserts that the literal format takes the arguments, without
+ *  evaluating them.
+ */
+#define XD_LOG_FORMAT_CHECK(format, ...)                                                \
+    static_assert(xd::util::internal::log_check_tuple<                                  \
+                      decltype(std::make_tuple(__VA_ARGS__))>::ok(format, false),       \
+                  "log format does not match its arguments")
+
+#endif  // XD_HAVE_CXX11
+
+#endif  // !__XD_UTIL_LOG_FORMAT_H__
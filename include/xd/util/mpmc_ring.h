@@ -0,0 +1,196 @@
+#ifndef __XD_UTIL_MPMC_RING_H__
+#define __XD_UTIL_MPMC_RING_H__
+
+#include <stdint.h>
+
+#include <cassert>
+#include <new>
+#include <stdexcept>
+#include <limits>
+
+#include <xd/topdef.h>
+#include <xd/util/mqueue.h>
+#include <xd/util/ring_mqueue.h>
+
+namespace xd { namespace util {
+
+/**
+ * mpmc_ring
+ *  Bounded multi-producer/multi-consumer ring over a preallocated array of
+ *  sequence-stamped slots, capacity rounded up to a power of two.  A slot
+ *  whose stamp equals the position is free for the producer claiming that
+ *  position, a stamp of position + 1 means it holds an item for the
+ *  consumer claiming it.  Producers and consumers only contend on m_tail
+ *  and m_head respectively, with one CAS per item and no allocation.
+ *
+ *  T's copy/move constructor must not throw, a claimed slot cannot be
+ *  given back.  Use it as
+ *      xd::util::mqueue<T, xd::util::mpmc_ring<T> > q(volumn);
+ */
+template <typename T>
+class mpmc_ring {
+  public:
+    explicit mpmc_ring(size_t volumn):
+      m_mask(round_up(volumn) - 1),
+      m_seqs(new size_t[m_mask + 1]),
+      m_slots(static_cast<T*>(::operator new(sizeof(T) * (m_mask + 1)))),
+      m_head(0),
+      m_tail(0) {
+        for (size_t i = 0; i <= m_mask; i++) {
+            m_seqs[i] = i;
+        }
+    }
+    ~mpmc_ring() {
+        for (size_t i = m_head; i != m_tail; i++) {
+            m_slots[i & m_mask].~T();
+        }
+        ::operator delete(m_slots);
+        delete[] m_seqs;
+    }
+    size_t capacity(void) const {
+        return m_mask + 1;
+    }
+    size_t size(void) const {
+        size_t head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+        size_t tail = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+        return static_cast<intptr_t>(tail - head) > 0 ? tail - head : 0;
+    }
+    // the slot at m_head holds no published item
+    bool empty(void) const {
+        size_t pos = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+        size_t seq = __atomic_load_n(&m_seqs[pos & m_mask], __ATOMIC_ACQUIRE);
+        return static_cast<intptr_t>(seq - (pos + 1)) < 0;
+    }
+    // the slot at m_tail is not yet released by its consumer
+    bool full(void) const {
+        size_t pos = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+        size_t seq = __atomic_load_n(&m_seqs[pos & m_mask], __ATOMIC_ACQUIRE);
+        return static_cast<intptr_t>(seq - pos) < 0;
+    }
+    bool try_put(const T& item) {
+        size_t pos;
+        if (!claim(&m_tail, 0, &pos)) {
+            return false;
+        }
+        new (&m_slots[pos & m_mask]) T(item);
+        __atomic_store_n(&m_seqs[pos & m_mask], pos + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+#ifdef XD_HAVE_CXX11
+    template <typename... Args>
+    bool try_emplace(Args&&... args) {
+        size_t pos;
+        if (!claim(&m_tail, 0, &pos)) {
+            return false;
+        }
+        new (&m_slots[pos & m_mask]) T(std::forward<Args>(args)...);
+        __atomic_store_n(&m_seqs[pos & m_mask], pos + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    bool try_put(T&& item) {
+        return try_emplace(std::move(item));
+    }
+#endif
+    template <typename InputIterator>
+    size_t try_put(InputIterator& first, InputIterator last) {
+        size_t i = 0;
+        size_t pos;
+        for (; first != last && claim(&m_tail, 0, &pos); i++, ++first) {
+            new (&m_slots[pos & m_mask]) T(*first);
+            __atomic_store_n(&m_seqs[pos & m_mask], pos + 1, __ATOMIC_RELEASE);
+        }
+        return i;
+    }
+    bool try_get(T* item) {
+        assert(item != 0);
+        size_t pos;
+        if (!claim(&m_head, 1, &pos)) {
+            return false;
+        }
+        T& slot = m_slots[pos & m_mask];
+        *item = XD_MOVE(slot);
+        slot.~T();
+        __atomic_store_n(&m_seqs[pos & m_mask], pos + m_mask + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    template <typename OutputIterator>
+    size_t try_get(OutputIterator& oit, size_t n) {
+        size_t i = 0;
+        size_t pos;
+        for (; i < n && claim(&m_head, 1, &pos); i++) {
+            T& slot = m_slots[pos & m_mask];
+            *oit = XD_MOVE(slot);
+            oit++;
+            slot.~T();
+            __atomic_store_n(&m_seqs[pos & m_mask], pos + m_mask + 1, __ATOMIC_RELEASE);
+        }
+        return i;
+    }
+
+  private:
+    static size_t round_up(size_t volumn) {
+        if (volumn == 0 || volumn > (std::numeric_limits<size_t>::max() >> 2) + 1) {
+            throw std::invalid_argument(_("bad ring volumn, must be bounded"));
+        }
+        size_t n = 1;
+        while (n < volumn) n <<= 1;
+        return n;
+    }
+    /**
+     * claim the position at *index whose slot is stamped position + lag,
+     * lag is 0 for producers and 1 for consumers.
+     */
+    bool claim(size_t* index, size_t lag, size_t* pos) {
+        size_t cur = __atomic_load_n(index, __ATOMIC_RELAXED);
+        for (;;) {
+            size_t seq = __atomic_load_n(&m_seqs[cur & m_mask], __ATOMIC_ACQUIRE);
+            intptr_t dif = static_cast<intptr_t>(seq - (cur + lag));
+            if (dif == 0) {
+                if (__atomic_compare_exchange_n(index, &cur, cur + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    *pos = cur;
+                    return true;
+                }
+            }
+            else if (dif < 0) {
+                return false;
+            }
+            else {
+                cur = __atomic_load_n(index, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+  private:
+    // non-copyable
+    mpmc_ring(const mpmc_ring&);
+    mpmc_ring& operator=(const mpmc_ring&);
+
+  private:
+    // read-only after construction
+    const size_t m_mask;
+    size_t* const m_seqs;
+    T* const m_slots;
+
+    char m_pad0[XD_CACHELINE_SIZE];
+    size_t m_head;              // claimed by consumers
+
+    char m_pad1[XD_CACHELINE_SIZE - sizeof(size_t)];
+    size_t m_tail;              // claimed by producers
+
+    char m_pad2[XD_CACHELINE_SIZE - sizeof(size_t)];
+};
+
+template <typename T>
+class mqueue<T, mpmc_ring<T> >: public internal::ring_mqueue<T, mpmc_ring<T> > {
+  public:
+    explicit mqueue(size_t volumn,
+                    const wait_policy& policy = wait_policy(internal::ring_mqueue<T, mpmc_ring<T> >::SPIN_LIMIT)):
+      internal::ring_mqueue<T, mpmc_ring<T> >(volumn, policy) {
+    }
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_MPMC_RING_H__
@@ -2,529 +2,811 @@
 #define __XD_UTIL_MQUEUE_H__
 
 #include <IceUtil/Mutex.h>
-#include <IceUtil/Cond.h>
 
+#include <cassert>
 #include <deque>
+#include <iterator>
 #include <list>
 #include <vector>
 #include <limits>
+#include <utility>
+
+#include <xd/topdef.h>
+#include <xd/util/coroutine.h>
+#include <xd/util/deadline.h>
+#include <xd/util/event_flag.h>
+#include <xd/util/mqueue_stats.h>
+#include <xd/util/waitqueue.h>
+
+#ifdef XD_HAVE_COROUTINES
+#   include <optional>
+#endif
 
 namespace xd { namespace util {
 
-template <typename T, typename Container = std::deque<T> >
+/**
+ * unit_sizer
+ *  mqueue's default Sizer, every item counts one against volumn.
+ */
+struct unit_sizer {
+    template <typename T>
+    size_t operator()(const T&) const {
+        return 1;
+    }
+};
+
+/**
+ * mqueue
+ *  Blocking bounded queue.  Every timed_* call runs against a deadline on
+ *  the monotonic clock, see xd::util::deadline.
+ *
+ *  Waiters park on a waitqueue after the spin/yield phase of the given
+ *  wait_policy, and every put/get wakes only as many of them as items or
+ *  slots it made available.
+ *
+ *  With XD_HAVE_CXX11 items are moved, not copied, out of the queue, and
+ *  put(T&&)/emplace() move or build them in place, so move-only payloads
+ *  work.  To move a batch in, pass std::make_move_iterator ranges to put.
+ *
+ *  Built with -DXD_MQUEUE_STATS, it counts depth, puts/gets, blocked time
+ *  and lock contention, see stats(); without it the counting compiles
+ *  away.  Every translation unit must agree on XD_MQUEUE_STATS.
+ *
+ *  An event loop which cannot block in get()/put() asks for readable_fd()
+ *  or writable_fd() and polls them with its sockets, then drains with
+ *  timed_get(0, ...) or timed_drain(0, ...).
+ *
+ *  volumn is counted in Sizer units, one per item by default.  With a
+ *  Sizer returning the bytes of an item it becomes a byte budget: a put
+ *  waits until its item fits in what is left, or the queue is empty so
+ *  that an oversized item still gets through.  Range puts, append() and
+ *  emplace() wait only for the queue not to be full, as with items.
+ *  Sizer must give an item the same size for as long as it is queued.
+ *
+ *      struct record_bytes {
+ *          size_t operator()(const std::string& r) const { return r.size(); }
+ *      };
+ *      xd::util::mqueue<std::string, std::deque<std::string>, record_bytes> q(64 << 20);
+ *
+ *  With XD_HAVE_COROUTINES, co_get()/co_put() suspend a coroutine instead
+ *  of parking its thread, and have it resumed on the given executor once
+ *  the item was handed over, so many pipeline stages share a few threads:
+ *
+ *      xd::util::executor pool(4);
+ *      for (;;) {
+ *          record r = co_await in.co_get(pool);
+ *          co_await out.co_put(pool, transform(std::move(r)));
+ *      }
+ *
+ *  Suspended coroutines are served ahead of parked threads.  There is no
+ *  timed form, and a suspended coroutine must not be destroyed.
+ */
+template <typename T, typename Container = std::deque<T>, typename Sizer = unit_sizer>
 class mqueue {
   public:
-    mqueue(size_t volumn = std::numeric_limits<size_t>::max()):
+    mqueue(size_t volumn = std::numeric_limits<size_t>::max(),
+           const wait_policy& policy = wait_policy(),
+           const Sizer& sizer = Sizer()):
       m_volumn(volumn),
-      m_nWaitingReader(0),
-      m_nWaitingWriter(0) {
+      m_policy(policy),
+      m_sizer(sizer),
+      m_used(0),
+      m_high(0),
+      m_low(0),
+      m_pressured(false) {
     }
     T get(void) {
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (m_queue.empty()) {
-            try {
-                ++m_nWaitingReader;
-                m_forNotEmpty.wait(lock);
-                --m_nWaitingReader;
-            } catch (...) {
-                --m_nWaitingReader;
-                throw;
-            }
-        }
-        T item(*m_queue.begin());
-        m_queue.erase(m_queue.begin());
-        if (m_nWaitingWriter > 0) {
-            m_forNotFull.broadcast();
-        }
+        locker lock(this);
+        wait_for_not_empty(lock, 0);
+        size_t size = m_sizer(m_queue.front());
+        T item(XD_MOVE(m_queue.front()));
+        erase_front(size);
         return item;
     }
     template <typename OutputIterator>
     size_t get(OutputIterator oit, size_t n) {
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (m_queue.empty()) {
-            try {
-                ++m_nWaitingReader;
-                m_forNotEmpty.wait(lock);
-                --m_nWaitingReader;
-            } catch (...) {
-                --m_nWaitingReader;
-                throw;
-            }
-        }
-        typename Container::iterator it = m_queue.begin();
-        size_t i;
-        for (i = 0; i < n && it != m_queue.end(); i++) {
-            *oit = *it;
-            oit++;
-            it++;
-        }
-        m_queue.erase(m_queue.begin(), it);
-        if (m_nWaitingWriter > 0) {
-            m_forNotFull.broadcast();
-        }
-        return i;
+        locker lock(this);
+        wait_for_not_empty(lock, 0);
+        return take(oit, n);
     }
     template <typename Carrier>
     void get(size_t n, Carrier* carrier) {
         assert(carrier != 0);
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (m_queue.empty()) {
-            try {
-                ++m_nWaitingReader;
-                m_forNotEmpty.wait(lock);
-                --m_nWaitingReader;
-            } catch (...) {
-                --m_nWaitingReader;
-                throw;
-            }
-        }
-        typename Container::iterator it = m_queue.begin();
-        for (size_t i = 0; i < n && it != m_queue.end(); i++, it++) {
-            continue;
-        }
-        carrier->assign(m_queue.begin(), it);
-        m_queue.erase(m_queue.begin(), it);
-        if (m_nWaitingWriter > 0) {
-            m_forNotFull.broadcast();
-        }
+        locker lock(this);
+        wait_for_not_empty(lock, 0);
+        take(n, carrier);
         return;
     }
     bool timed_get(unsigned usecs, T* item) {
-        IceUtil::Time timeout =
-                IceUtil::Time::microSeconds(static_cast<IceUtil::Int64>(usecs));
-        bool waited = true;
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (waited && m_queue.empty()) {
-            try {
-                ++m_nWaitingReader;
-                waited = m_forNotEmpty.timedWait(lock, timeout);
-                --m_nWaitingReader;
-            } catch (...) {
-                --m_nWaitingReader;
-                throw;
-            }
-        }
-        if (waited) {
-            T item(*m_queue.begin());
-            m_queue.erase(m_queue.begin());
-            if (m_nWaitingWriter > 0) {
-                m_forNotFull.broadcast();
-            }
-        } 
-        return waited;
+        assert(item != 0);
+        deadline until(usecs);
+        locker lock(this);
+        if (!wait_for_not_empty(lock, &until).first) {
+            return false;
+        }
+        pop_front(item);
+        return true;
     }
     /**
      * passes as 0, indicating unlimited
      * (false, _)       -- have not gotten a item for mut-ex
      * (true, false)    -- have not gotten a item for always emptiness.
      * (true, true)     -- bingo
+     * usecs bounds the whole call, not each pass.
      */
     std::pair<bool, bool> timed_get(unsigned usecs, unsigned passes, T* item) {
         if (passes == 0) {
-            return std::make_pair<bool, bool>(timed_get(usecs, item), true);
-        }
-        IceUtil::Time timeout =
-                IceUtil::Time::microSeconds(static_cast<IceUtil::Int64>(usecs));
-        bool waited = true;
-        unsigned pass = 0;
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (waited && m_queue.empty() && pass < passes) {
-            try {
-                ++m_nWaitingReader;
-                waited = m_forNotEmpty.timedWait(lock, timeout);
-                --m_nWaitingReader;
-            } catch (...) {
-                --m_nWaitingReader;
-                throw;
-            }
-            pass++;
-        }
-        if (waited && !m_queue.empty()) {
-            T item(*m_queue.begin());
-            m_queue.erase(m_queue.begin());
-            if (m_nWaitingWriter > 0) {
-                m_forNotFull.broadcast();
-            }
-            // no matter whether pass is less than passes or not.
-            return std::make_pair<bool, bool>(true, true);
+            return std::make_pair(timed_get(usecs, item), true);
         }
-        else {
-            return std::make_pair<bool, bool>(waited, pass < passes);
+        assert(item != 0);
+        deadline until(usecs);
+        locker lock(this);
+        std::pair<bool, bool> waited = wait_for_not_empty(lock, &until, passes);
+        if (!m_queue.empty()) {
+            pop_front(item);
         }
+        return waited;
     }
     template <typename Carrier>
     bool timed_get(unsigned usecs, size_t n, Carrier* carrier) {
         assert(carrier != 0);
-        IceUtil::Time timeout =
-                IceUtil::Time::microSeconds(static_cast<IceUtil::Int64>(usecs));
-        bool waited = true;
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (waited && m_queue.empty()) {
-            try {
-                ++m_nWaitingReader;
-                waited = m_forNotEmpty.timedWait(lock, timeout);
-                --m_nWaitingReader;
-            } catch (...) {
-                --m_nWaitingReader;
-                throw;
-            }
+        deadline until(usecs);
+        locker lock(this);
+        if (!wait_for_not_empty(lock, &until).first) {
+            return false;
         }
-        if (waited) {
-            typename Container::iterator it = m_queue.begin();
-            for (size_t i = 0; i < n; i++) {
-                if (it == m_queue.end()) break;
-                it++;
-            }
-            carrier->assign(m_queue.begin(), it);
-            m_queue.erase(m_queue.begin(), it);
-            if (m_nWaitingWriter > 0) {
-                m_forNotFull.broadcast();
-            }
-        } 
-        return waited;
+        take(n, carrier);
+        return true;
     }
     template <typename Carrier>
     std::pair<bool, bool> timed_get(unsigned usecs, unsigned passes, size_t n, Carrier* carrier) {
         if (passes == 0) {
-            return std::make_pair<bool, bool>(timed_get(usecs, n, carrier), true);
+            return std::make_pair(timed_get(usecs, n, carrier), true);
         }
         assert(carrier != 0);
-        IceUtil::Time timeout =
-                IceUtil::Time::microSeconds(static_cast<IceUtil::Int64>(usecs));
-        bool waited = true;
-        unsigned pass = 0;
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (waited && m_queue.empty() && pass < passes) {
-            try {
-                ++m_nWaitingReader;
-                waited = m_forNotEmpty.timedWait(lock, timeout);
-                --m_nWaitingReader;
-            } catch (...) {
-                --m_nWaitingReader;
-                throw;
-            }
-            pass++;
-        }
-        if (waited && !m_queue.empty()) {
-            typename Container::iterator it = m_queue.begin();
-            for (size_t i = 0; i < n; i++) {
-                if (it == m_queue.end()) break;
-                it++;
-            }
-            carrier->assign(m_queue.begin(), it);
-            m_queue.erase(m_queue.begin(), it);
-            if (m_nWaitingWriter > 0) {
-                m_forNotFull.broadcast();
-            }
-            return std::make_pair<bool, bool>(true, true);
-        }
-        else {
-            return std::make_pair<bool, bool>(waited, pass < passes);
+        deadline until(usecs);
+        locker lock(this);
+        std::pair<bool, bool> waited = wait_for_not_empty(lock, &until, passes);
+        if (!m_queue.empty()) {
+            take(n, carrier);
         }
+        return waited;
     }
     template <typename OutputIterator>
     bool timed_get(unsigned usecs, OutputIterator oit, size_t n, size_t* m = 0) {
-        IceUtil::Time timeout =
-                IceUtil::Time::microSeconds(static_cast<IceUtil::Int64>(usecs));
-        bool waited = true;
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (waited && m_queue.empty()) {
-            try {
-                ++m_nWaitingReader;
-                waited = m_forNotEmpty.timedWait(lock, timeout);
-                --m_nWaitingReader;
-            } catch (...) {
-                --m_nWaitingReader;
-                throw;
-            }
-        }
-        if (waited) {
-            typename Container::iterator it = m_queue.begin();
-            size_t i;
-            for (i = 0; i < n && it != m_queue.end(); i++) {
-                *oit = *it;
-                oit++;
-                it++;
-            }
-            m_queue.erase(m_queue.begin(), it);
-            if (m) *m = i;
-            if (m_nWaitingWriter > 0) {
-                m_forNotFull.broadcast();
-            }
-        } 
-        return waited;
+        deadline until(usecs);
+        locker lock(this);
+        if (!wait_for_not_empty(lock, &until).first) {
+            return false;
+        }
+        size_t i = take(oit, n);
+        if (m) *m = i;
+        return true;
     }
     template <typename OutputIterator>
-    std::pair<bool, bool> timed_get(unsigned usecs, unsigned passes, 
+    std::pair<bool, bool> timed_get(unsigned usecs, unsigned passes,
                                     OutputIterator oit, size_t n, size_t* m = 0) {
-        if (passes = 0) {
-            return std::make_pair<bool, bool>(time_get(usecs, oit, n, m), true);
-        }
-        IceUtil::Time timeout = IceUtil::Time::microSeconds(static_cast<IceUtil::Int64>(usecs));
-        bool waited = true;
-        unsigned pass = 0;
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (waited && m_queue.empty() && pass < passes) {
-            try {
-                ++m_nWaitingReader;
-                waited = m_forNotEmpty.timedWait(lock, timeout);
-                --m_nWaitingReader;
-            } catch (...) {
-                --m_nWaitingReader;
-                throw;
-            }
+        if (passes == 0) {
+            return std::make_pair(timed_get(usecs, oit, n, m), true);
         }
-        if (waited && !m_queue.empty()) {
-            typename Container::iterator it = m_queue.begin();
-            size_t i;
-            for (i = 0; i < n && it != m_queue.end(); i++) {
-                *oit = *it;
-                oit++;
-                it++;
-            }
-            m_queue.erase(m_queue.begin(), it);
+        deadline until(usecs);
+        locker lock(this);
+        std::pair<bool, bool> waited = wait_for_not_empty(lock, &until, passes);
+        if (!m_queue.empty()) {
+            size_t i = take(oit, n);
             if (m) *m = i;
-            if (m_nWaitingWriter > 0) {
-                m_forNotFull.broadcast();
-            }
-	    return std::make_pair<bool, bool>(true, true);
-        } 
-        else {
-            return std::make_pair<bool, bool>(waited, pass < passes);
         }
+        return waited;
+    }
+    /**
+     * swap the whole queue with *batch in O(1), so the lock is held for
+     * the same time whatever the backlog.  *batch is cleared first, hand
+     * back an empty container to keep the swap cheap.
+     * returns the number of items drained.
+     */
+    size_t drain(Container* batch) {
+        assert(batch != 0);
+        batch->clear();
+        locker lock(this);
+        wait_for_not_empty(lock, 0);
+        m_queue.swap(*batch);
+        account(0, m_used);
+        notify_not_full(batch->size());
+        return batch->size();
+    }
+    bool timed_drain(unsigned usecs, Container* batch) {
+        assert(batch != 0);
+        batch->clear();
+        deadline until(usecs);
+        locker lock(this);
+        if (!wait_for_not_empty(lock, &until).first) {
+            return false;
+        }
+        m_queue.swap(*batch);
+        account(0, m_used);
+        notify_not_full(batch->size());
+        return true;
     }
     void put(const T& item) {
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (m_queue.size() >= m_volumn) {
-            try {
-                ++m_nWaitingWriter;
-                m_forNotFull.wait(lock);
-                --m_nWaitingWriter;
-            } catch (...) {
-                --m_nWaitingWriter;
-                throw;
-            }
-        }
-        m_queue.push_back(item);
-        if (m_nWaitingReader > 0) {
-            m_forNotEmpty.broadcast();
-        }
+        locker lock(this);
+        size_t size = m_sizer(item);
+        wait_for_not_full(lock, 0, 0, size);
+        push_back(item, size);
         return;
     }
     bool timed_put(unsigned usecs, const T& item) {
-        IceUtil::Time timeout =
-                IceUtil::Time::microSeconds(static_cast<IceUtil::Int64>(usecs));
-        bool waited = true;
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (waited && m_queue.size() >= m_volumn) {
-            try {
-                ++m_nWaitingWriter;
-                m_forNotFull.wait(lock);
-                --m_nWaitingWriter;
-            } catch (...) {
-                --m_nWaitingWriter;
-                throw;
-            }
-        }
-        if (waited) {
-            m_queue.push_back(item);
-            if (m_nWaitingReader > 0) {
-                m_forNotEmpty.broadcast();
-            }
-        }
-        return waited;
+        deadline until(usecs);
+        locker lock(this);
+        size_t size = m_sizer(item);
+        if (!wait_for_not_full(lock, &until, 0, size).first) {
+            return false;
+        }
+        push_back(item, size);
+        return true;
     }
     std::pair<bool, bool> timed_put(unsigned usecs, unsigned passes, const T& item) {
         if (passes == 0) {
-            return std::make_pair<bool, bool>(timed_put(usecs, item), true);
+            return std::make_pair(timed_put(usecs, item), true);
         }
-        IceUtil::Time timeout =
-                IceUtil::Time::microSeconds(static_cast<IceUtil::Int64>(usecs));
-        bool waited = true;
-        unsigned pass = 0;
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (waited && m_queue.size() >= m_volumn && pass < passes) {
-            try {
-                ++m_nWaitingWriter;
-                m_forNotFull.wait(lock);
-                --m_nWaitingWriter;
-            } catch (...) {
-                --m_nWaitingWriter;
-                throw;
-            }
-            pass++;
-        }
-        if (waited && m_queue.size() < m_volumn) {
-            m_queue.push_back(item);
-            if (m_nWaitingReader > 0) {
-                m_forNotEmpty.broadcast();
-            }
-            return std::make_pair<bool, bool>(true, true);
-        }
-        else {
-            return std::make_pair<bool, bool>(waited, pass < passes);
+        deadline until(usecs);
+        locker lock(this);
+        size_t size = m_sizer(item);
+        std::pair<bool, bool> waited = wait_for_not_full(lock, &until, passes, size);
+        if (fits(size)) {
+            push_back(item, size);
         }
+        return waited;
+    }
+#ifdef XD_HAVE_CXX11
+    void put(T&& item) {
+        locker lock(this);
+        size_t size = m_sizer(item);
+        wait_for_not_full(lock, 0, 0, size);
+        push_back(std::move(item), size);
+        return;
     }
+    bool timed_put(unsigned usecs, T&& item) {
+        deadline until(usecs);
+        locker lock(this);
+        size_t size = m_sizer(item);
+        if (!wait_for_not_full(lock, &until, 0, size).first) {
+            return false;
+        }
+        push_back(std::move(item), size);
+        return true;
+    }
+    template <typename... Args>
+    void emplace(Args&&... args) {
+        locker lock(this);
+        wait_for_not_full(lock, 0);
+        m_queue.emplace_back(std::forward<Args>(args)...);
+        account(m_sizer(m_queue.back()), 0);
+        notify_not_empty(1);
+        return;
+    }
+    template <typename... Args>
+    bool timed_emplace(unsigned usecs, Args&&... args) {
+        deadline until(usecs);
+        locker lock(this);
+        if (!wait_for_not_full(lock, &until).first) {
+            return false;
+        }
+        m_queue.emplace_back(std::forward<Args>(args)...);
+        account(m_sizer(m_queue.back()), 0);
+        notify_not_empty(1);
+        return true;
+    }
+#endif
+#ifdef XD_HAVE_COROUTINES
+    template <typename Executor>
+    class get_awaitable;
+    template <typename Executor>
+    class put_awaitable;
+    /**
+     * co_await q.co_get(ex) gives the item, resuming on ex if it had to
+     * suspend.
+     */
+    template <typename Executor>
+    get_awaitable<Executor> co_get(Executor& ex) {
+        return get_awaitable<Executor>(this, ex);
+    }
+    template <typename Executor>
+    put_awaitable<Executor> co_put(Executor& ex, T item) {
+        return put_awaitable<Executor>(this, ex, std::move(item));
+    }
+#endif
     template <typename Carrier>
     void put(const Carrier& carrier) {
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (m_queue.size() >= m_volumn) {
-            try {
-                ++m_nWaitingWriter;
-                m_forNotFull.wait(lock);
-                --m_nWaitingWriter;
-            }
-            catch (...) {
-                --m_nWaitingWriter;
-                throw;
-            }
-        }
-        m_queue.insert(m_queue.end(), carrier.begin(), carrier.end());
-        if (m_nWaitingReader > 0) {
-            m_forNotEmpty.broadcast();
-        }
+        put(carrier.begin(), carrier.end());
         return;
     }
     template <typename Carrier>
     bool timed_put(unsigned usecs, const Carrier& carrier) {
-        IceUtil::Time timeout =
-                IceUtil::Time::microSeconds(static_cast<IceUtil::Int64>(usecs));
-        bool waited = true;
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (waited && m_queue.size() >= m_volumn) {
-            try {
-                ++m_nWaitingWriter;
-                m_forNotFull.wait(lock);
-                --m_nWaitingWriter;
-            } catch (...) {
-                --m_nWaitingWriter;
-                throw;
-            }
-        }
-        if (waited) {
-            m_queue.insert(m_queue.end(), carrier.begin(), carrier.end());
-            if (m_nWaitingReader > 0) {
-                m_forNotEmpty.broadcast();
-            }
-        }
-        return waited;
+        return timed_put(usecs, carrier.begin(), carrier.end());
     }
     template <typename Carrier>
     std::pair<bool, bool> timed_put(unsigned usecs, unsigned passes, const Carrier& carrier) {
-        if (passes == 0) {
-            return std::make_pair<bool, bool>(timed_put(usecs, carrier), true);
-        }
-        IceUtil::Time timeout =
-                IceUtil::Time::microSeconds(static_cast<IceUtil::Int64>(usecs));
-        bool waited = true;
-        unsigned pass = 0;
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (waited && m_queue.size() >= m_volumn && pass < passes) {
-            try {
-                ++m_nWaitingWriter;
-                m_forNotFull.wait(lock);
-                --m_nWaitingWriter;
-            } catch (...) {
-                --m_nWaitingWriter;
-                throw;
-            }
-            pass++;
-        }
-        if (waited && m_queue.size() < m_volumn) {
-            m_queue.insert(m_queue.end(), carrier.begin(), carrier.end());
-            if (m_nWaitingReader > 0) {
-                m_forNotEmpty.broadcast();
-            }
-            return std::make_pair<bool, bool>(true, true);
-        }
-        else {
-            return std::make_pair<bool, bool>(waited, pass < passes);
-        }
+        return timed_put(usecs, passes, carrier.begin(), carrier.end());
     }
     template <typename InputIterator>
     void put(InputIterator first, InputIterator last) {
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (m_queue.size() >= m_volumn) {
-            try {
-                ++m_nWaitingWriter;
-                m_forNotFull.wait(lock);
-                --m_nWaitingWriter;
-            } catch (...) {
-                --m_nWaitingWriter;
-                throw;
-            }
-        }
-        m_queue.insert(m_queue.end(), first, last);
-        if (m_nWaitingReader > 0) {
-            m_forNotEmpty.broadcast();
-        }
+        locker lock(this);
+        wait_for_not_full(lock, 0);
+        notify_not_empty(insert(first, last));
         return;
     }
     template <typename InputIterator>
     bool timed_put(unsigned int usecs, InputIterator first, InputIterator last) {
-        IceUtil::Time timeout =
-                IceUtil::Time::microSeconds(static_cast<IceUtil::Int64>(usecs));
-        bool waited = true;
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (waited && m_queue.size() >= m_volumn) {
-            try {
-                ++m_nWaitingWriter;
-                m_forNotFull.wait(lock);
-                --m_nWaitingWriter;
-            } catch (...) {
-                --m_nWaitingWriter;
-                throw;
-            }
+        deadline until(usecs);
+        locker lock(this);
+        if (!wait_for_not_full(lock, &until).first) {
+            return false;
         }
-        if (waited) {
-            m_queue.insert(m_queue.end(), first, last);
-            if (m_nWaitingReader > 0) {
-                m_forNotEmpty.broadcast();
-            }
-        }
-        return waited;
+        notify_not_empty(insert(first, last));
+        return true;
     }
     template <typename InputIterator>
     std::pair<bool, bool> timed_put(unsigned usecs, unsigned passes, InputIterator first, InputIterator last) {
         if (passes == 0) {
-            return std::make_pair<bool, bool>(timed_put(usecs, first, last), true);
+            return std::make_pair(timed_put(usecs, first, last), true);
+        }
+        deadline until(usecs);
+        locker lock(this);
+        std::pair<bool, bool> waited = wait_for_not_full(lock, &until, passes);
+        if (fits(1)) {
+            notify_not_empty(insert(first, last));
         }
-        IceUtil::Time timeout =
-                IceUtil::Time::microSeconds(static_cast<IceUtil::Int64>(usecs));
+        return waited;
+    }
+
+    /**
+     * append a prepared *batch, in O(1) by swap if the queue is empty.
+     * *batch is left empty.  Like put(first, last) it waits only for the
+     * queue not to be full.
+     */
+    void append(Container* batch) {
+        assert(batch != 0);
+        {
+            locker lock(this);
+            wait_for_not_full(lock, 0);
+            notify_not_empty(splice(batch));
+        }
+        batch->clear();
+        return;
+    }
+    bool timed_append(unsigned usecs, Container* batch) {
+        assert(batch != 0);
+        deadline until(usecs);
+        {
+            locker lock(this);
+            if (!wait_for_not_full(lock, &until).first) {
+                return false;
+            }
+            notify_not_empty(splice(batch));
+        }
+        batch->clear();
+        return true;
+    }
+    /**
+     * an eventfd which polls readable while the queue is not empty, made
+     * on first call; only then do puts/gets signal it, on the transitions.
+     * Do not read it, it is cleared when the queue runs empty.  The queue
+     * owns and closes it.
+     */
+    int readable_fd(void) {
+        locker lock(this);
+        return m_readable.open(!m_queue.empty());
+    }
+    /**
+     * likewise, readable while the queue is not full.
+     */
+    int writable_fd(void) {
+        locker lock(this);
+        return m_writable.open(fits(1));
+    }
+    /**
+     * Sizer units queued.
+     */
+    size_t used(void) const {
+        return __atomic_load_n(&m_used, __ATOMIC_RELAXED);
+    }
+    /**
+     * report pressure from the moment used() reaches high until it is back
+     * down to low, so upstream stages can shed load before puts block.
+     * high 0 turns it off.
+     */
+    void watermarks(size_t high, size_t low) {
+        assert(high == 0 || low < high);
+        locker lock(this);
+        m_high = high;
+        m_low = low;
+        signal_pressure();
+    }
+    // lock-free, cheap enough to check before every put
+    bool pressured(void) const {
+        return __atomic_load_n(&m_pressured, __ATOMIC_RELAXED);
+    }
+    /**
+     * an eventfd which polls readable while pressured(), like readable_fd().
+     */
+    int pressure_fd(void) {
+        locker lock(this);
+        return m_pressure.open(m_pressured);
+    }
+    /**
+     * a copy of the counters, cheap enough to poll from a monitoring
+     * thread, it does not take m_mutex.  All zero without XD_MQUEUE_STATS.
+     */
+    mqueue_stats stats(void) const {
+        mqueue_stats snapshot;
+        m_stats.snapshot(&snapshot);
+        return snapshot;
+    }
+
+#ifdef XD_HAVE_COROUTINES
+  public:
+    // a coroutine waiting in co_get/co_put, which hands the item over
+    class co_getter: public internal::co_waiter {
+      protected:
+        template <typename Executor>
+        explicit co_getter(Executor& ex): internal::co_waiter(ex) {
+        }
+        friend class mqueue;
+        std::optional<T> m_item;
+    };
+    class co_putter: public internal::co_waiter {
+      protected:
+        template <typename Executor>
+        co_putter(Executor& ex, T&& item): internal::co_waiter(ex), m_item(std::move(item)), m_size(0) {
+        }
+        friend class mqueue;
+        T m_item;
+        size_t m_size;
+    };
+    template <typename Executor>
+    class get_awaitable: public co_getter {
+      public:
+        get_awaitable(mqueue* owner, Executor& ex): co_getter(ex), m_owner(owner) {
+        }
+        bool await_ready(void) const noexcept {
+            return false;
+        }
+        bool await_suspend(std::coroutine_handle<> handle) {
+            return m_owner->co_suspend_get(this, handle);
+        }
+        T await_resume(void) {
+            return std::move(*this->m_item);
+        }
+
+      private:
+        mqueue* m_owner;
+    };
+    template <typename Executor>
+    class put_awaitable: public co_putter {
+      public:
+        put_awaitable(mqueue* owner, Executor& ex, T&& item): co_putter(ex, std::move(item)), m_owner(owner) {
+        }
+        bool await_ready(void) const noexcept {
+            return false;
+        }
+        bool await_suspend(std::coroutine_handle<> handle) {
+            return m_owner->co_suspend_put(this, handle);
+        }
+        void await_resume(void) const noexcept {
+        }
+
+      private:
+        mqueue* m_owner;
+    };
+
+#endif
+  private:
+    /**
+     * m_mutex held, counting the acquisitions which had to wait for it.
+     * Coroutines made ready under the lock are resumed after it is
+     * released, an inline executor must not run them under it.
+     */
+    class locker: public IceUtil::Mutex::TryLock {
+      public:
+        explicit locker(mqueue* queue): IceUtil::Mutex::TryLock(queue->m_mutex), m_queue(queue) {
+            if (!acquired()) {
+                queue->m_stats.on_contended();
+                acquire();
+            }
+        }
+#ifdef XD_HAVE_COROUTINES
+        ~locker() {
+            if (!m_queue->m_coReady.empty()) {
+                internal::co_waiter_list ready;
+                ready.swap(m_queue->m_coReady);
+                release();
+                ready.resume_all();
+            }
+        }
+#endif
+
+      private:
+        mqueue* m_queue;
+    };
+
+  private:
+    /**
+     * wait until the queue is not empty, until passed (0 for no limit)
+     * or passes wake-ups found it still empty (0 for no limit).
+     * returns as timed_get(usecs, passes, ...).
+     */
+    std::pair<bool, bool> wait_for_not_empty(IceUtil::Mutex::Lock& lock,
+                                             const deadline* until, unsigned passes = 0) {
         bool waited = true;
         unsigned pass = 0;
-        IceUtil::Mutex::Lock lock(m_mutex);
-        while (waited && m_queue.size() >= m_volumn && pass < passes) {
-            try {
-                ++m_nWaitingWriter;
-                m_forNotFull.wait(lock);
-                --m_nWaitingWriter;
-            } catch (...) {
-                --m_nWaitingWriter;
-                throw;
-            }
+        while (waited && m_queue.empty() && (passes == 0 || pass < passes)) {
+            waited = wait(m_forNotEmpty, lock, until);
+            pass++;
+        }
+        if (!m_queue.empty()) {
+            return std::make_pair(true, true);
+        }
+        return std::make_pair(waited, passes == 0 || pass < passes);
+    }
+    /**
+     * likewise until an item of size units fits, see fits().
+     */
+    std::pair<bool, bool> wait_for_not_full(IceUtil::Mutex::Lock& lock, const deadline* until,
+                                            unsigned passes = 0, size_t size = 1) {
+        bool waited = true;
+        unsigned pass = 0;
+        while (waited && !fits(size) && (passes == 0 || pass < passes)) {
+            waited = wait(m_forNotFull, lock, until);
+            pass++;
         }
-        if (waited && m_queue.size() < m_volumn) {
-            m_queue.insert(m_queue.end(), first, last);
-            if (m_nWaitingReader > 0) {
-                m_forNotEmpty.broadcast();
+        if (fits(size)) {
+            return std::make_pair(true, true);
+        }
+        return std::make_pair(waited, passes == 0 || pass < passes);
+    }
+    /**
+     * park on wq with m_mutex released, the ticket is taken under the lock
+     * so a put/get in between is never missed.
+     */
+    bool wait(waitqueue& wq, IceUtil::Mutex::Lock& lock, const deadline* until) {
+        IceUtil::Int64 since = m_stats.clock();
+        int ticket = wq.prepare_wait();
+        lock.release();
+        bool waited = wq.wait(ticket, m_policy, until);
+        lock.acquire();
+        m_stats.on_blocked(&wq == &m_forNotFull, since);
+        return waited;
+    }
+    // n items were put, m_mutex held
+    void notify_not_empty(size_t n) {
+        m_stats.on_put(n, m_queue);
+        serve_coroutines();
+        if (m_forNotEmpty.notify(n)) {
+            m_stats.on_notify();
+        }
+        signal_events();
+    }
+    // n items were gotten, m_mutex held
+    void notify_not_full(size_t n) {
+        m_stats.on_get(n, m_queue);
+        serve_coroutines();
+        if (m_forNotFull.notify(n)) {
+            m_stats.on_notify();
+        }
+        signal_events();
+    }
+#ifdef XD_HAVE_COROUTINES
+    /**
+     * hand items to suspended co_gets and room to suspended co_puts, in
+     * arrival order, for as long as either can go on.  m_mutex held.
+     */
+    void serve_coroutines(void) {
+        bool served = true;
+        while (served) {
+            served = false;
+            while (!m_coGetters.empty() && !m_queue.empty()) {
+                co_getter* w = static_cast<co_getter*>(m_coGetters.pop_front());
+                size_t size = m_sizer(m_queue.front());
+                w->m_item.emplace(std::move(m_queue.front()));
+                m_queue.erase(m_queue.begin());
+                account(0, size);
+                m_stats.on_get(1, m_queue);
+                m_forNotFull.notify(1);
+                m_coReady.push_back(w);
+                served = true;
+            }
+            while (!m_coPutters.empty() && fits(static_cast<co_putter*>(m_coPutters.front())->m_size)) {
+                co_putter* w = static_cast<co_putter*>(m_coPutters.pop_front());
+                m_queue.push_back(std::move(w->m_item));
+                account(w->m_size, 0);
+                m_stats.on_put(1, m_queue);
+                m_forNotEmpty.notify(1);
+                m_coReady.push_back(w);
+                served = true;
             }
-            return std::make_pair<bool, bool>(true, true);
         }
-        else {
-            return std::make_pair<bool, bool>(waited, pass < passes);
+    }
+    // false to go on at once, the item being there
+    bool co_suspend_get(co_getter* w, std::coroutine_handle<> handle) {
+        locker lock(this);
+        if (!m_queue.empty()) {
+            size_t size = m_sizer(m_queue.front());
+            w->m_item.emplace(std::move(m_queue.front()));
+            erase_front(size);
+            return false;
+        }
+        w->suspend(handle);
+        m_coGetters.push_back(w);
+        return true;
+    }
+    bool co_suspend_put(co_putter* w, std::coroutine_handle<> handle) {
+        locker lock(this);
+        w->m_size = m_sizer(w->m_item);
+        if (m_coPutters.empty() && fits(w->m_size)) {
+            push_back(std::move(w->m_item), w->m_size);
+            return false;
+        }
+        w->suspend(handle);
+        m_coPutters.push_back(w);
+        return true;
+    }
+#else
+    void serve_coroutines(void) {
+    }
+#endif
+    // bring the fds of readable_fd()/writable_fd() to the queue's state
+    void signal_events(void) {
+        if (m_readable.opened() || m_writable.opened()) {
+            m_readable.assign(!m_queue.empty());
+            m_writable.assign(fits(1));
+        }
+        signal_pressure();
+    }
+    void signal_pressure(void) {
+        bool pressured = m_pressured;
+        if (m_high == 0) {
+            pressured = false;
+        }
+        else if (m_used >= m_high) {
+            pressured = true;
         }
+        else if (m_used <= m_low) {
+            pressured = false;
+        }
+        __atomic_store_n(&m_pressured, pressured, __ATOMIC_RELAXED);
+        m_pressure.assign(pressured);
+    }
+    /**
+     * an item of size units may go in, the queue being empty or having
+     * room for it.
+     */
+    bool fits(size_t size) const {
+        return m_used == 0 || (m_used < m_volumn && size <= m_volumn - m_used);
+    }
+    // m_used += in - out, m_mutex held
+    void account(size_t in, size_t out) {
+        __atomic_store_n(&m_used, m_used + in - out, __ATOMIC_RELAXED);
+    }
+    void push_back(const T& item, size_t size) {
+        m_queue.push_back(item);
+        account(size, 0);
+        notify_not_empty(1);
+    }
+#ifdef XD_HAVE_CXX11
+    void push_back(T&& item, size_t size) {
+        m_queue.push_back(std::move(item));
+        account(size, 0);
+        notify_not_empty(1);
+    }
+#endif
+    void erase_front(size_t size) {
+        m_queue.erase(m_queue.begin());
+        account(0, size);
+        notify_not_full(1);
+    }
+    void pop_front(T* item) {
+        size_t size = m_sizer(m_queue.front());
+        *item = XD_MOVE(m_queue.front());
+        erase_front(size);
+    }
+    /**
+     * the Sizer units in [first, last), without a pass for unit_sizer.
+     */
+    template <typename Iterator>
+    size_t measure(Iterator first, Iterator last) const {
+        return measure(first, last, static_cast<Sizer*>(0));
+    }
+    template <typename Iterator, typename S>
+    size_t measure(Iterator first, Iterator last, const S*) const {
+        size_t sum = 0;
+        for (; first != last; ++first) {
+            sum += m_sizer(*first);
+        }
+        return sum;
+    }
+    template <typename Iterator>
+    size_t measure(Iterator first, Iterator last, const unit_sizer*) const {
+        return std::distance(first, last);
+    }
+    template <typename InputIterator>
+    size_t insert(InputIterator first, InputIterator last) {
+        size_t before = m_queue.size();
+        m_queue.insert(m_queue.end(), first, last);
+        size_t n = m_queue.size() - before;
+        typename Container::iterator added = m_queue.end();
+        std::advance(added, -static_cast<long>(n));
+        account(measure(added, m_queue.end()), 0);
+        return n;
+    }
+    size_t splice(Container* batch) {
+        if (m_queue.empty()) {
+            m_queue.swap(*batch);
+            account(measure(m_queue.begin(), m_queue.end()), 0);
+            return m_queue.size();
+        }
+#ifdef XD_HAVE_CXX11
+        return insert(std::make_move_iterator(batch->begin()), std::make_move_iterator(batch->end()));
+#else
+        return insert(batch->begin(), batch->end());
+#endif
+    }
+    template <typename OutputIterator>
+    size_t take(OutputIterator oit, size_t n) {
+        typename Container::iterator it = m_queue.begin();
+        size_t i;
+        size_t size = 0;
+        for (i = 0; i < n && it != m_queue.end(); i++) {
+            size += m_sizer(*it);
+            *oit = XD_MOVE(*it);
+            oit++;
+            it++;
+        }
+        m_queue.erase(m_queue.begin(), it);
+        account(0, size);
+        notify_not_full(i);
+        return i;
+    }
+    template <typename Carrier>
+    void take(size_t n, Carrier* carrier) {
+        typename Container::iterator it = m_queue.begin();
+        size_t i;
+        size_t size = 0;
+        for (i = 0; i < n && it != m_queue.end(); i++, it++) {
+            size += m_sizer(*it);
+        }
+#ifdef XD_HAVE_CXX11
+        carrier->assign(std::make_move_iterator(m_queue.begin()), std::make_move_iterator(it));
+#else
+        carrier->assign(m_queue.begin(), it);
+#endif
+        m_queue.erase(m_queue.begin(), it);
+        account(0, size);
+        notify_not_full(i);
+        return;
     }
 
   private:
     unsigned long m_volumn;
     Container m_queue;
-    short m_nWaitingWriter;
-    short m_nWaitingReader;
+    wait_policy m_policy;
+    Sizer m_sizer;
+    size_t m_used;              // Sizer units in m_queue
+    size_t m_high;
+    size_t m_low;
+    bool m_pressured;
 
     IceUtil::Mutex m_mutex;
-    IceUtil::Cond m_forNotFull;
-    IceUtil::Cond m_forNotEmpty;
+    waitqueue m_forNotFull;
+    waitqueue m_forNotEmpty;
+    internal::mqueue_counters_type m_stats;
+    event_flag m_readable;
+    event_flag m_writable;
+    event_flag m_pressure;
+#ifdef XD_HAVE_COROUTINES
+    internal::co_waiter_list m_coGetters;
+    internal::co_waiter_list m_coPutters;
+    internal::co_waiter_list m_coReady;    // to resume once m_mutex is released
+#endif
 };
 
 } // namespace util
@@ -0,0 +1,165 @@
+#ifndef __XD_UTIL_MQUEUE_STATS_H__
+#define __XD_UTIL_MQUEUE_STATS_H__
+
+#include <IceUtil/Time.h>
+
+#include <cstring>
+
+#include <xd/topdef.h>
+
+namespace xd { namespace util {
+
+/**
+ * mqueue_stats
+ *  A copy of an mqueue's counters, as returned by mqueue::stats().
+ *  blocked_on_full[i]/blocked_on_empty[i] count the waits which lasted
+ *  [2^(i-1), 2^i) microseconds, bucket 0 is under 1us and the last one
+ *  holds everything longer.  contended counts lock acquisitions which
+ *  found m_mutex taken, notifies the put/get calls which woke somebody.
+ */
+struct mqueue_stats {
+    static const unsigned BUCKETS = 26;     // the last is 2^24us ~ 16s and up
+
+    mqueue_stats() {
+        memset(this, 0, sizeof(*this));
+    }
+    // the upper bound in microseconds of bucket i
+    static IceUtil::Int64 bucket_limit(unsigned i) {
+        return static_cast<IceUtil::Int64>(1) << i;
+    }
+
+    unsigned long depth;
+    unsigned long high_water;
+    unsigned long long puts;
+    unsigned long long gets;
+    unsigned long long contended;
+    unsigned long long notifies;
+    unsigned long long blocked_on_full[BUCKETS];
+    unsigned long long blocked_on_empty[BUCKETS];
+    unsigned long long usecs_on_full;
+    unsigned long long usecs_on_empty;
+};
+
+namespace internal {
+
+/**
+ * mqueue_counters
+ *  The live counters behind mqueue_stats.  Every update is made by the
+ *  thread holding the queue's mutex, so they are plain relaxed loads and
+ *  stores, no locked read-modify-write on the hot path; snapshot() may run
+ *  on any thread without the mutex and sees each counter untorn.
+ */
+class mqueue_counters {
+  public:
+    mqueue_counters() {
+    }
+    static IceUtil::Int64 clock(void) {
+        return IceUtil::Time::now(IceUtil::Time::Monotonic).toMicroSeconds();
+    }
+    template <typename Container>
+    void on_put(size_t n, const Container& queue) {
+        add(&m_stats.puts, n);
+        set_depth(queue.size());
+    }
+    template <typename Container>
+    void on_get(size_t n, const Container& queue) {
+        add(&m_stats.gets, n);
+        set_depth(queue.size());
+    }
+    void on_contended(void) {
+        add(&m_stats.contended, 1);
+    }
+    void on_notify(void) {
+        add(&m_stats.notifies, 1);
+    }
+    void on_blocked(bool full, IceUtil::Int64 since) {
+        IceUtil::Int64 usecs = clock() - since;
+        unsigned i = 0;
+        while (i + 1 < mqueue_stats::BUCKETS && usecs >= mqueue_stats::bucket_limit(i)) {
+            i++;
+        }
+        if (full) {
+            add(&m_stats.blocked_on_full[i], 1);
+            add(&m_stats.usecs_on_full, usecs);
+        }
+        else {
+            add(&m_stats.blocked_on_empty[i], 1);
+            add(&m_stats.usecs_on_empty, usecs);
+        }
+    }
+    void snapshot(mqueue_stats* stats) const {
+        stats->depth = load(&m_stats.depth);
+        stats->high_water = load(&m_stats.high_water);
+        stats->puts = load(&m_stats.puts);
+        stats->gets = load(&m_stats.gets);
+        stats->contended = load(&m_stats.contended);
+        stats->notifies = load(&m_stats.notifies);
+        for (unsigned i = 0; i < mqueue_stats::BUCKETS; i++) {
+            stats->blocked_on_full[i] = load(&m_stats.blocked_on_full[i]);
+            stats->blocked_on_empty[i] = load(&m_stats.blocked_on_empty[i]);
+        }
+        stats->usecs_on_full = load(&m_stats.usecs_on_full);
+        stats->usecs_on_empty = load(&m_stats.usecs_on_empty);
+    }
+
+  private:
+    template <typename U, typename V>
+    static void add(U* counter, V n) {
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    }
+    template <typename U>
+    static U load(const U* counter) {
+        return __atomic_load_n(counter, __ATOMIC_RELAXED);
+    }
+    void set_depth(size_t depth) {
+        __atomic_store_n(&m_stats.depth, depth, __ATOMIC_RELAXED);
+        if (depth > __atomic_load_n(&m_stats.high_water, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&m_stats.high_water, depth, __ATOMIC_RELAXED);
+        }
+    }
+
+  private:
+    mqueue_stats m_stats;
+};
+
+/**
+ * null_mqueue_counters
+ *  What mqueue keeps without XD_MQUEUE_STATS: every hook is empty and
+ *  compiles away, stats() reports all zeroes.
+ */
+class null_mqueue_counters {
+  public:
+    static IceUtil::Int64 clock(void) {
+        return 0;
+    }
+    template <typename Container>
+    void on_put(size_t, const Container&) {
+    }
+    template <typename Container>
+    void on_get(size_t, const Container&) {
+    }
+    void on_contended(void) {
+    }
+    void on_notify(void) {
+    }
+    void on_blocked(bool, IceUtil::Int64) {
+    }
+    void snapshot(mqueue_stats*) const {
+    }
+};
+
+/**
+ * build with -DXD_MQUEUE_STATS to count, the hooks cost nothing otherwise.
+ */
+#ifdef XD_MQUEUE_STATS
+typedef mqueue_counters mqueue_counters_type;
+#else
+typedef null_mqueue_counters mqueue_counters_type;
+#endif
+
+}  // namespace internal
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_MQUEUE_STATS_H__
@@ -0,0 +1,287 @@
+#ifndef __XD_UTIL_MULTICAST_RING_H__
+#define __XD_UTIL_MULTICAST_RING_H__
+
+#include <sched.h>
+
+#include <IceUtil/Mutex.h>
+
+#include <cassert>
+#include <limits>
+#include <stdexcept>
+
+#include <xd/topdef.h>
+#include <xd/util/deadline.h>
+#include <xd/util/memory.h>
+#include <xd/util/waitqueue.h>
+
+namespace xd { namespace util {
+
+/**
+ * multicast_ring
+ *  Single-producer ring read by several independent consumer groups, in
+ *  the disruptor style: every reader sees every entry, reading it in
+ *  place, and tracks its own cursor; the producer reuses a slot only when
+ *  the slowest reader has released it.  One copy of the stream feeds any
+ *  number of consumers.
+ *
+ *      xd::util::multicast_ring<record> ring(64 * 1024);
+ *      xd::util::multicast_ring<record>::reader* indexer = ring.subscribe();
+ *
+ *      // producer                     // indexer thread
+ *      record& r = ring.claim();       size_t n = indexer->wait();
+ *      fill(&r);                       for (size_t i = 0; i < n; i++) index(indexer->at(i));
+ *      ring.publish();                 indexer->release(n);
+ *
+ *  Slots are default constructed once and then assigned over.  A reader
+ *  is driven by one thread at a time, and subscribes at the current end
+ *  of the stream; readers are owned by the ring.
+ */
+template <typename T>
+class multicast_ring {
+  public:
+    static const unsigned SPIN_LIMIT = 128;
+    static const unsigned MAX_READERS = 32;
+
+    class reader {
+      public:
+        /**
+         * wait until an entry past the cursor is published, returns how many
+         * are, at most n.
+         */
+        size_t wait(size_t n = std::numeric_limits<size_t>::max()) {
+            size_t avail;
+            while ((avail = available()) == 0) {
+                m_ring->wait_for_published(m_cursor, 0);
+            }
+            return avail < n ? avail : n;
+        }
+        // false if until passed with nothing published, *n as wait()
+        bool timed_wait(unsigned usecs, size_t* n) {
+            assert(n != 0);
+            deadline until(usecs);
+            size_t avail;
+            while ((avail = available()) == 0) {
+                if (!m_ring->wait_for_published(m_cursor, &until)) {
+                    return false;
+                }
+            }
+            *n = avail < *n ? avail : *n;
+            return true;
+        }
+        size_t available(void) const {
+            return __atomic_load_n(&m_ring->m_tail, __ATOMIC_ACQUIRE) - m_cursor;
+        }
+        // the i-th entry past the cursor, valid until released
+        const T& at(size_t i) const {
+            assert(i < available());
+            return m_ring->m_slots[(m_cursor + i) & m_ring->m_mask];
+        }
+        void release(size_t n) {
+            assert(n <= available());
+            __atomic_store_n(&m_cursor, m_cursor + n, __ATOMIC_RELEASE);
+            m_ring->m_forReleased.notify(1);
+        }
+        T get(void) {
+            wait(1);
+            T item(at(0));
+            release(1);
+            return item;
+        }
+        bool timed_get(unsigned usecs, T* item) {
+            assert(item != 0);
+            size_t n = 1;
+            if (!timed_wait(usecs, &n)) {
+                return false;
+            }
+            *item = at(0);
+            release(1);
+            return true;
+        }
+        size_t cursor(void) const {
+            return m_cursor;
+        }
+
+      private:
+        friend class multicast_ring;
+        explicit reader(multicast_ring* ring, size_t cursor): m_ring(ring), m_cursor(cursor) {
+        }
+        reader(const reader&);
+        reader& operator=(const reader&);
+
+      private:
+        char m_pad0[XD_CACHELINE_SIZE];
+        multicast_ring* m_ring;
+        size_t m_cursor;        // next sequence to read, written by the reader only
+        char m_pad1[XD_CACHELINE_SIZE];
+    };
+
+  public:
+    explicit multicast_ring(size_t volumn, const wait_policy& policy = wait_policy(SPIN_LIMIT)):
+      m_mask(round_up(volumn) - 1),
+      m_slots(new T[m_mask + 1]),
+      m_policy(policy),
+      m_nReaders(0),
+      m_claimed(0),
+      m_slowest(0),
+      m_tail(0) {
+    }
+    ~multicast_ring() {
+        for (unsigned i = 0; i < m_nReaders; i++) {
+            delete m_readers[i];
+        }
+    }
+    size_t capacity(void) const {
+        return m_mask + 1;
+    }
+    /**
+     * a new consumer group, starting at the next entry to be published.
+     */
+    reader* subscribe(void) {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        if (m_nReaders == MAX_READERS) {
+            throw std::length_error(_("multicast_ring has too many readers"));
+        }
+        reader* r = new reader(this, __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE));
+        m_readers[m_nReaders] = r;
+        __atomic_store_n(&m_nReaders, m_nReaders + 1, __ATOMIC_RELEASE);
+        return r;
+    }
+    /**
+     * the slot for the next entry, waiting for the slowest reader to free
+     * it; fill it in place and publish().  Producer only.
+     */
+    T& claim(void) {
+        wait_for_free(0);
+        return m_slots[m_claimed & m_mask];
+    }
+    bool timed_claim(unsigned usecs, T** slot) {
+        assert(slot != 0);
+        deadline until(usecs);
+        if (!wait_for_free(&until)) {
+            return false;
+        }
+        *slot = &m_slots[m_claimed & m_mask];
+        return true;
+    }
+    void publish(void) {
+        m_claimed++;
+        __atomic_store_n(&m_tail, m_claimed, __ATOMIC_RELEASE);
+        m_forPublished.notify_all();
+    }
+    void put(const T& item) {
+        claim() = item;
+        publish();
+        return;
+    }
+    bool timed_put(unsigned usecs, const T& item) {
+        T* slot;
+        if (!timed_claim(usecs, &slot)) {
+            return false;
+        }
+        *slot = item;
+        publish();
+        return true;
+    }
+
+  private:
+    static size_t round_up(size_t volumn) {
+        if (volumn == 0 || volumn > (std::numeric_limits<size_t>::max() >> 2) + 1) {
+            throw std::invalid_argument(_("bad ring volumn, must be bounded"));
+        }
+        size_t n = 1;
+        while (n < volumn) n <<= 1;
+        return n;
+    }
+    // the lowest reader cursor, or the tail without readers
+    size_t slowest(void) const {
+        size_t min = m_claimed;
+        unsigned n = __atomic_load_n(&m_nReaders, __ATOMIC_ACQUIRE);
+        for (unsigned i = 0; i < n; i++) {
+            size_t cursor = __atomic_load_n(&m_readers[i]->m_cursor, __ATOMIC_ACQUIRE);
+            if (cursor < min) {
+                min = cursor;
+            }
+        }
+        return min;
+    }
+    bool full(void) {
+        if (m_claimed - m_slowest <= m_mask) {
+            return false;
+        }
+        m_slowest = slowest();
+        return m_claimed - m_slowest > m_mask;
+    }
+    bool wait_for_free(const deadline* until) {
+        unsigned i = 0;
+        while (full()) {
+            if (i < m_policy.spins) {
+                XD_CPU_RELAX();
+            }
+            else if (i < m_policy.spins + m_policy.yields) {
+                sched_yield();
+            }
+            else {
+                int ticket = m_forReleased.prepare_wait();
+                if (!full()) {
+                    m_forReleased.cancel_wait();
+                    break;
+                }
+                if (!m_forReleased.wait(ticket, wait_policy(), until)) {
+                    return !full();
+                }
+            }
+            i++;
+        }
+        return true;
+    }
+    bool wait_for_published(size_t cursor, const deadline* until) {
+        for (unsigned i = 0; i < m_policy.spins + m_policy.yields; i++) {
+            if (__atomic_load_n(&m_tail, __ATOMIC_ACQUIRE) != cursor) {
+                return true;
+            }
+            if (i < m_policy.spins) {
+                XD_CPU_RELAX();
+            }
+            else {
+                sched_yield();
+            }
+        }
+        int ticket = m_forPublished.prepare_wait();
+        if (__atomic_load_n(&m_tail, __ATOMIC_ACQUIRE) != cursor) {
+            m_forPublished.cancel_wait();
+            return true;
+        }
+        return m_forPublished.wait(ticket, wait_policy(), until);
+    }
+
+  private:
+    // non-copyable
+    multicast_ring(const multicast_ring&);
+    multicast_ring& operator=(const multicast_ring&);
+
+  private:
+    // read-only after construction
+    const size_t m_mask;
+    scoped_array<T> m_slots;
+    wait_policy m_policy;
+
+    IceUtil::Mutex m_mutex;     // subscribe only
+    reader* m_readers[MAX_READERS];
+    unsigned m_nReaders;
+
+    char m_pad0[XD_CACHELINE_SIZE];
+    size_t m_claimed;           // producer only
+    size_t m_slowest;           // producer's cache of slowest()
+
+    char m_pad1[XD_CACHELINE_SIZE - 2 * sizeof(size_t)];
+    size_t m_tail;              // published, read by every reader
+
+    char m_pad2[XD_CACHELINE_SIZE - sizeof(size_t)];
+    waitqueue m_forPublished;
+    waitqueue m_forReleased;
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_MULTICAST_RING_H__
@@ -0,0 +1,314 @@
+#ifndef __XD_UTIL_PRIORITY_MQUEUE_H__
+#define __XD_UTIL_PRIORITY_MQUEUE_H__
+
+#include <IceUtil/Mutex.h>
+
+#include <cassert>
+#include <deque>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+#include <xd/topdef.h>
+#include <xd/util/deadline.h>
+#include <xd/util/memory.h>
+#include <xd/util/waitqueue.h>
+
+namespace xd { namespace util {
+
+/**
+ * priority_mqueue
+ *  mqueue with a few priority levels, 0 the highest, each its own lane
+ *  bounded by volumn, so a saturated bulk lane never makes a control put
+ *  wait.  get() picks the lane by
+ *      STRICT      the highest non-empty level, except that a level
+ *                  passed over starvation_limit() times while non-empty
+ *                  is served next, so a get's wait is bounded by
+ *                  levels * starvation_limit() items ahead of it;
+ *      WEIGHTED    smooth weighted round robin over the non-empty levels,
+ *                  level i getting weight(i) of every sum-of-weights gets,
+ *                  by default 2^(levels-1-i).
+ *  FIFO within a level.  The blocking/timed surface is mqueue's with the
+ *  level in front of the item on put, without the passes overloads.
+ */
+template <typename T>
+class priority_mqueue {
+  public:
+    typedef enum {
+        STRICT = 0,
+        WEIGHTED
+    } order_type;
+    static const unsigned MAX_LEVELS = 16;
+    static const unsigned DEFAULT_STARVATION_LIMIT = 64;
+
+  public:
+    explicit priority_mqueue(unsigned levels,
+                             size_t volumn = std::numeric_limits<size_t>::max(),
+                             order_type order = STRICT,
+                             const wait_policy& policy = wait_policy()):
+      m_nLevels(levels),
+      m_lanes(levels > 0 && levels <= MAX_LEVELS ? new lane[levels] : 0),
+      m_volumn(volumn),
+      m_order(order),
+      m_policy(policy),
+      m_starvation_limit(DEFAULT_STARVATION_LIMIT),
+      m_size(0) {
+        if (levels == 0 || levels > MAX_LEVELS) {
+            throw std::invalid_argument(_("priority_mqueue levels must be in [1, 16]"));
+        }
+        for (unsigned i = 0; i < levels; i++) {
+            m_lanes[i].weight = 1u << (levels - 1 - i);
+        }
+    }
+    unsigned levels(void) const {
+        return m_nLevels;
+    }
+    size_t size(void) const {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        return m_size;
+    }
+    size_t size(unsigned level) const {
+        check(level);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        return m_lanes[level].queue.size();
+    }
+    /**
+     * STRICT only, 0 serves strictly by level and may starve.
+     */
+    void starvation_limit(unsigned gets) {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        m_starvation_limit = gets;
+    }
+    unsigned starvation_limit(void) const {
+        return m_starvation_limit;
+    }
+    // WEIGHTED only
+    void weight(unsigned level, unsigned w) {
+        check(level);
+        if (w == 0) {
+            throw std::invalid_argument(_("priority_mqueue weight must be positive"));
+        }
+        IceUtil::Mutex::Lock lock(m_mutex);
+        m_lanes[level].weight = w;
+    }
+    unsigned weight(unsigned level) const {
+        check(level);
+        return m_lanes[level].weight;
+    }
+    T get(void) {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        wait_for_not_empty(lock, 0);
+        lane& l = m_lanes[pick()];
+        T item(XD_MOVE(l.queue.front()));
+        pop(l);
+        return item;
+    }
+    /**
+     * *level, if given, is where the item came from.
+     */
+    bool timed_get(unsigned usecs, T* item, unsigned* level = 0) {
+        assert(item != 0);
+        deadline until(usecs);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        if (!wait_for_not_empty(lock, &until)) {
+            return false;
+        }
+        unsigned i = pick();
+        *item = XD_MOVE(m_lanes[i].queue.front());
+        pop(m_lanes[i]);
+        if (level) *level = i;
+        return true;
+    }
+    template <typename OutputIterator>
+    size_t get(OutputIterator oit, size_t n) {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        wait_for_not_empty(lock, 0);
+        return take(oit, n);
+    }
+    template <typename OutputIterator>
+    bool timed_get(unsigned usecs, OutputIterator oit, size_t n, size_t* m = 0) {
+        deadline until(usecs);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        if (!wait_for_not_empty(lock, &until)) {
+            return false;
+        }
+        size_t i = take(oit, n);
+        if (m) *m = i;
+        return true;
+    }
+    void put(unsigned level, const T& item) {
+        check(level);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        wait_for_not_full(lock, level, 0);
+        push(level, item);
+        return;
+    }
+    bool timed_put(unsigned usecs, unsigned level, const T& item) {
+        check(level);
+        deadline until(usecs);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        if (!wait_for_not_full(lock, level, &until)) {
+            return false;
+        }
+        push(level, item);
+        return true;
+    }
+#ifdef XD_HAVE_CXX11
+    void put(unsigned level, T&& item) {
+        check(level);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        wait_for_not_full(lock, level, 0);
+        push(level, std::move(item));
+        return;
+    }
+    bool timed_put(unsigned usecs, unsigned level, T&& item) {
+        check(level);
+        deadline until(usecs);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        if (!wait_for_not_full(lock, level, &until)) {
+            return false;
+        }
+        push(level, std::move(item));
+        return true;
+    }
+#endif
+
+  private:
+    struct lane {
+        lane(): weight(1), current(0), bypassed(0) {
+        }
+        std::deque<T> queue;
+        waitqueue forNotFull;
+        unsigned weight;
+        long current;           // WEIGHTED credit
+        unsigned bypassed;      // STRICT gets which passed this lane over
+    };
+
+  private:
+    void check(unsigned level) const {
+        if (level >= m_nLevels) {
+            throw std::out_of_range(_("priority_mqueue level out of range"));
+        }
+    }
+    bool wait_for_not_empty(IceUtil::Mutex::Lock& lock, const deadline* until) {
+        bool waited = true;
+        while (waited && m_size == 0) {
+            waited = wait(m_forNotEmpty, lock, until);
+        }
+        return m_size > 0;
+    }
+    bool wait_for_not_full(IceUtil::Mutex::Lock& lock, unsigned level, const deadline* until) {
+        bool waited = true;
+        while (waited && m_lanes[level].queue.size() >= m_volumn) {
+            waited = wait(m_lanes[level].forNotFull, lock, until);
+        }
+        return m_lanes[level].queue.size() < m_volumn;
+    }
+    bool wait(waitqueue& wq, IceUtil::Mutex::Lock& lock, const deadline* until) {
+        int ticket = wq.prepare_wait();
+        lock.release();
+        bool waited = wq.wait(ticket, m_policy, until);
+        lock.acquire();
+        return waited;
+    }
+    void push(unsigned level, const T& item) {
+        m_lanes[level].queue.push_back(item);
+        m_size++;
+        m_forNotEmpty.notify(1);
+    }
+#ifdef XD_HAVE_CXX11
+    void push(unsigned level, T&& item) {
+        m_lanes[level].queue.push_back(std::move(item));
+        m_size++;
+        m_forNotEmpty.notify(1);
+    }
+#endif
+    void pop(lane& l) {
+        l.queue.pop_front();
+        m_size--;
+        l.forNotFull.notify(1);
+    }
+    /**
+     * the level the next item comes from, m_size > 0.
+     */
+    unsigned pick(void) {
+        return m_order == STRICT ? pick_strict() : pick_weighted();
+    }
+    unsigned pick_strict(void) {
+        unsigned first = m_nLevels;
+        unsigned starved = m_nLevels;
+        for (unsigned i = 0; i < m_nLevels; i++) {
+            if (m_lanes[i].queue.empty()) {
+                continue;
+            }
+            if (first == m_nLevels) {
+                first = i;
+            }
+            else if (starved == m_nLevels && m_starvation_limit > 0 &&
+                     m_lanes[i].bypassed >= m_starvation_limit) {
+                starved = i;
+            }
+        }
+        unsigned chosen = (starved != m_nLevels ? starved : first);
+        for (unsigned i = 0; i < m_nLevels; i++) {
+            if (i == chosen || m_lanes[i].queue.empty()) {
+                m_lanes[i].bypassed = 0;
+            }
+            else {
+                m_lanes[i].bypassed++;
+            }
+        }
+        return chosen;
+    }
+    unsigned pick_weighted(void) {
+        long total = 0;
+        unsigned chosen = m_nLevels;
+        for (unsigned i = 0; i < m_nLevels; i++) {
+            lane& l = m_lanes[i];
+            if (l.queue.empty()) {
+                l.current = 0;
+                continue;
+            }
+            l.current += l.weight;
+            total += l.weight;
+            if (chosen == m_nLevels || l.current > m_lanes[chosen].current) {
+                chosen = i;
+            }
+        }
+        m_lanes[chosen].current -= total;
+        return chosen;
+    }
+    template <typename OutputIterator>
+    size_t take(OutputIterator oit, size_t n) {
+        size_t i;
+        for (i = 0; i < n && m_size > 0; i++) {
+            lane& l = m_lanes[pick()];
+            *oit = XD_MOVE(l.queue.front());
+            oit++;
+            pop(l);
+        }
+        return i;
+    }
+
+  private:
+    // non-copyable
+    priority_mqueue(const priority_mqueue&);
+    priority_mqueue& operator=(const priority_mqueue&);
+
+  private:
+    const unsigned m_nLevels;
+    scoped_array<lane> m_lanes;
+    const size_t m_volumn;      // per level
+    const order_type m_order;
+    wait_policy m_policy;
+    unsigned m_starvation_limit;
+    size_t m_size;
+
+    IceUtil::Mutex m_mutex;
+    waitqueue m_forNotEmpty;
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_PRIORITY_MQUEUE_H__
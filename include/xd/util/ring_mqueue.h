@@ -0,0 +1,363 @@
+#ifndef __XD_UTIL_RING_MQUEUE_H__
+#define __XD_UTIL_RING_MQUEUE_H__
+
+#include <sched.h>
+
+#include <cassert>
+#include <iterator>
+#include <utility>
+
+#include <xd/topdef.h>
+#include <xd/util/deadline.h>
+#include <xd/util/waitqueue.h>
+
+namespace xd { namespace util {
+
+namespace internal {
+
+/**
+ * ring_mqueue
+ *  The blocking mqueue surface over a lock-free Ring, which provides
+ *      bool try_put(const T&),  size_t try_put(InputIterator&, InputIterator)
+ *      bool try_get(T*),        size_t try_get(OutputIterator&, size_t)
+ *      bool empty(), bool full(), size_t capacity()
+ *  and, with XD_HAVE_CXX11, try_put(T&&) and try_emplace(Args&&...) which
+ *  consume their arguments only when they succeed.
+ *  Callers poll the ring per wait_policy and park on m_forNotEmpty/
+ *  m_forNotFull only when it is really empty/full.  The waitqueues are
+ *  fenced against the ring indices, so put/get make no syscall unless
+ *  somebody is parked, and then wake only as many as they made room for.
+ *
+ *  Range puts are not atomic: if the ring fills up the rest of the range
+ *  waits for room, and a timed_put which times out has already enqueued a
+ *  prefix of the range.
+ */
+template <typename T, typename Ring>
+class ring_mqueue {
+  public:
+    static const unsigned SPIN_LIMIT = 128;
+
+  public:
+    explicit ring_mqueue(size_t volumn, const wait_policy& policy = wait_policy(SPIN_LIMIT)):
+      m_ring(volumn),
+      m_policy(policy) {
+    }
+    size_t volumn(void) const {
+        return m_ring.capacity();
+    }
+    T get(void) {
+        T item;
+        while (!m_ring.try_get(&item)) {
+            wait_for_readable(0);
+        }
+        notify_writers(1);
+        return item;
+    }
+    template <typename OutputIterator>
+    size_t get(OutputIterator oit, size_t n) {
+        size_t i;
+        while ((i = m_ring.try_get(oit, n)) == 0 && n > 0) {
+            wait_for_readable(0);
+        }
+        notify_writers(i);
+        return i;
+    }
+    template <typename Carrier>
+    void get(size_t n, Carrier* carrier) {
+        assert(carrier != 0);
+        carrier->clear();
+        get(std::back_inserter(*carrier), n);
+        return;
+    }
+    bool timed_get(unsigned usecs, T* item) {
+        assert(item != 0);
+        deadline until(usecs);
+        while (!m_ring.try_get(item)) {
+            if (!wait_for_readable(&until)) {
+                return false;
+            }
+        }
+        notify_writers(1);
+        return true;
+    }
+    /**
+     * passes counts the wake-ups which found the ring drained by another
+     * reader, see mqueue::timed_get.
+     */
+    std::pair<bool, bool> timed_get(unsigned usecs, unsigned passes, T* item) {
+        if (passes == 0) {
+            return std::make_pair(timed_get(usecs, item), true);
+        }
+        assert(item != 0);
+        deadline until(usecs);
+        unsigned pass = 0;
+        while (!m_ring.try_get(item)) {
+            if (pass >= passes) {
+                return std::make_pair(true, false);
+            }
+            if (!wait_for_readable(&until)) {
+                return std::make_pair(false, true);
+            }
+            pass++;
+        }
+        notify_writers(1);
+        return std::make_pair(true, true);
+    }
+    template <typename Carrier>
+    bool timed_get(unsigned usecs, size_t n, Carrier* carrier) {
+        assert(carrier != 0);
+        carrier->clear();
+        return timed_get(usecs, std::back_inserter(*carrier), n);
+    }
+    template <typename Carrier>
+    std::pair<bool, bool> timed_get(unsigned usecs, unsigned passes, size_t n, Carrier* carrier) {
+        assert(carrier != 0);
+        carrier->clear();
+        return timed_get(usecs, passes, std::back_inserter(*carrier), n);
+    }
+    template <typename OutputIterator>
+    bool timed_get(unsigned usecs, OutputIterator oit, size_t n, size_t* m = 0) {
+        deadline until(usecs);
+        size_t i;
+        while ((i = m_ring.try_get(oit, n)) == 0 && n > 0) {
+            if (!wait_for_readable(&until)) {
+                return false;
+            }
+        }
+        if (m) *m = i;
+        notify_writers(i);
+        return true;
+    }
+    template <typename OutputIterator>
+    std::pair<bool, bool> timed_get(unsigned usecs, unsigned passes,
+                                    OutputIterator oit, size_t n, size_t* m = 0) {
+        if (passes == 0) {
+            return std::make_pair(timed_get(usecs, oit, n, m), true);
+        }
+        deadline until(usecs);
+        unsigned pass = 0;
+        size_t i;
+        while ((i = m_ring.try_get(oit, n)) == 0 && n > 0) {
+            if (pass >= passes) {
+                return std::make_pair(true, false);
+            }
+            if (!wait_for_readable(&until)) {
+                return std::make_pair(false, true);
+            }
+            pass++;
+        }
+        if (m) *m = i;
+        notify_writers(i);
+        return std::make_pair(true, true);
+    }
+    void put(const T& item) {
+        while (!m_ring.try_put(item)) {
+            wait_for_writable(0);
+        }
+        notify_readers(1);
+        return;
+    }
+    bool timed_put(unsigned usecs, const T& item) {
+        deadline until(usecs);
+        while (!m_ring.try_put(item)) {
+            if (!wait_for_writable(&until)) {
+                return false;
+            }
+        }
+        notify_readers(1);
+        return true;
+    }
+    std::pair<bool, bool> timed_put(unsigned usecs, unsigned passes, const T& item) {
+        if (passes == 0) {
+            return std::make_pair(timed_put(usecs, item), true);
+        }
+        deadline until(usecs);
+        unsigned pass = 0;
+        while (!m_ring.try_put(item)) {
+            if (pass >= passes) {
+                return std::make_pair(true, false);
+            }
+            if (!wait_for_writable(&until)) {
+                return std::make_pair(false, true);
+            }
+            pass++;
+        }
+        notify_readers(1);
+        return std::make_pair(true, true);
+    }
+#ifdef XD_HAVE_CXX11
+    void put(T&& item) {
+        while (!m_ring.try_put(std::move(item))) {
+            wait_for_writable(0);
+        }
+        notify_readers(1);
+        return;
+    }
+    bool timed_put(unsigned usecs, T&& item) {
+        deadline until(usecs);
+        while (!m_ring.try_put(std::move(item))) {
+            if (!wait_for_writable(&until)) {
+                return false;
+            }
+        }
+        notify_readers(1);
+        return true;
+    }
+    template <typename... Args>
+    void emplace(Args&&... args) {
+        while (!m_ring.try_emplace(std::forward<Args>(args)...)) {
+            wait_for_writable(0);
+        }
+        notify_readers(1);
+        return;
+    }
+    template <typename... Args>
+    bool timed_emplace(unsigned usecs, Args&&... args) {
+        deadline until(usecs);
+        while (!m_ring.try_emplace(std::forward<Args>(args)...)) {
+            if (!wait_for_writable(&until)) {
+                return false;
+            }
+        }
+        notify_readers(1);
+        return true;
+    }
+#endif
+    template <typename Carrier>
+    void put(const Carrier& carrier) {
+        put(carrier.begin(), carrier.end());
+        return;
+    }
+    template <typename Carrier>
+    bool timed_put(unsigned usecs, const Carrier& carrier) {
+        return timed_put(usecs, carrier.begin(), carrier.end());
+    }
+    template <typename Carrier>
+    std::pair<bool, bool> timed_put(unsigned usecs, unsigned passes, const Carrier& carrier) {
+        return timed_put(usecs, passes, carrier.begin(), carrier.end());
+    }
+    template <typename InputIterator>
+    void put(InputIterator first, InputIterator last) {
+        while (first != last) {
+            size_t i = m_ring.try_put(first, last);
+            if (i == 0) {
+                wait_for_writable(0);
+                continue;
+            }
+            notify_readers(i);
+        }
+        return;
+    }
+    template <typename InputIterator>
+    bool timed_put(unsigned usecs, InputIterator first, InputIterator last) {
+        deadline until(usecs);
+        while (first != last) {
+            size_t i = m_ring.try_put(first, last);
+            if (i == 0) {
+                if (!wait_for_writable(&until)) {
+                    return false;
+                }
+                continue;
+            }
+            notify_readers(i);
+        }
+        return true;
+    }
+    template <typename InputIterator>
+    std::pair<bool, bool> timed_put(unsigned usecs, unsigned passes, InputIterator first, InputIterator last) {
+        if (passes == 0) {
+            return std::make_pair(timed_put(usecs, first, last), true);
+        }
+        deadline until(usecs);
+        unsigned pass = 0;
+        while (first != last) {
+            size_t i = m_ring.try_put(first, last);
+            if (i == 0) {
+                if (pass >= passes) {
+                    return std::make_pair(true, false);
+                }
+                if (!wait_for_writable(&until)) {
+                    return std::make_pair(false, true);
+                }
+                pass++;
+                continue;
+            }
+            notify_readers(i);
+        }
+        return std::make_pair(true, true);
+    }
+
+  protected:
+    /**
+     * returns false only if until passed with the ring still empty.
+     */
+    bool wait_for_readable(const deadline* until) {
+        if (poll(&Ring::empty)) {
+            return true;
+        }
+        int ticket = m_forNotEmpty.prepare_wait();
+        if (!m_ring.empty()) {
+            m_forNotEmpty.cancel_wait();
+            return true;
+        }
+        return m_forNotEmpty.wait(ticket, wait_policy(), until) || !m_ring.empty();
+    }
+    bool wait_for_writable(const deadline* until) {
+        if (poll(&Ring::full)) {
+            return true;
+        }
+        int ticket = m_forNotFull.prepare_wait();
+        if (!m_ring.full()) {
+            m_forNotFull.cancel_wait();
+            return true;
+        }
+        return m_forNotFull.wait(ticket, wait_policy(), until) || !m_ring.full();
+    }
+    // spin/yield on the ring itself per m_policy, true once !(m_ring.*busy)()
+    bool poll(bool (Ring::*busy)(void) const) const {
+        for (unsigned i = 0; i < m_policy.spins; i++) {
+            if (!(m_ring.*busy)()) {
+                return true;
+            }
+            XD_CPU_RELAX();
+        }
+        for (unsigned i = 0; i < m_policy.yields; i++) {
+            if (!(m_ring.*busy)()) {
+                return true;
+            }
+            sched_yield();
+        }
+        return false;
+    }
+    void notify_readers(size_t n) {
+        m_forNotEmpty.notify(n);
+    }
+    void notify_writers(size_t n) {
+        m_forNotFull.notify(n);
+    }
+
+  private:
+    // non-copyable
+    ring_mqueue(const ring_mqueue&);
+    ring_mqueue& operator=(const ring_mqueue&);
+
+  protected:
+    Ring m_ring;
+    wait_policy m_policy;
+
+    // read by both sides on every put/get, so keep them off the ring's
+    // index lines
+    char m_pad0[XD_CACHELINE_SIZE];
+    waitqueue m_forNotFull;
+    waitqueue m_forNotEmpty;
+};
+
+template <typename T, typename Ring>
+const unsigned ring_mqueue<T, Ring>::SPIN_LIMIT;
+
+}  // namespace internal
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_RING_MQUEUE_H__
@@ -0,0 +1,405 @@
+#ifndef __XD_UTIL_SHARDED_MQUEUE_H__
+#define __XD_UTIL_SHARDED_MQUEUE_H__
+
+#include <pthread.h>
+#include <string.h>
+
+#include <IceUtil/Mutex.h>
+
+#include <cassert>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <xd/topdef.h>
+#include <xd/util/deadline.h>
+#include <xd/util/memory.h>
+#include <xd/util/waitqueue.h>
+
+namespace xd { namespace util {
+
+namespace internal {
+
+typedef enum {
+    PUT_LANE = 0,
+    GET_LANE,
+} lane_role;
+
+/**
+ * the lane the calling thread is pinned to as a producer or as a
+ * consumer, max() if none; callers take it modulo their lane count.
+ */
+inline size_t& thread_lane(lane_role role) {
+    static __thread size_t lanes[2] = {std::numeric_limits<size_t>::max(),
+                                       std::numeric_limits<size_t>::max()};
+    return lanes[role];
+}
+
+}  // namespace internal
+
+/**
+ * sharded_mqueue
+ *  mqueue split into lanes, each a short-locked deque on its own cache
+ *  line.  A thread puts into and gets from its home lanes, and a consumer
+ *  whose home lane is dry steals from the others, taking half of the
+ *  victim's lane so that the next gets are local again.  volumn bounds
+ *  the items of all lanes together.
+ *
+ *  Each queue hands out home lanes round robin, to its producers and to
+ *  its consumers apart, at their first call.  The n-th consumer then
+ *  shares the n-th producer's lane, which keeps the gets local only while
+ *  the two are as many and live as long; pin() the threads otherwise.
+ *
+ *  Order is FIFO per lane only.  The blocking/timed surface is mqueue's
+ *  without the passes overloads.
+ */
+template <typename T>
+class sharded_mqueue {
+  public:
+    explicit sharded_mqueue(size_t lanes,
+                            size_t volumn = std::numeric_limits<size_t>::max(),
+                            const wait_policy& policy = wait_policy()):
+      m_nLanes(lanes),
+      m_lanes(lanes > 0 ? new lane[lanes] : 0),
+      m_volumn(volumn),
+      m_policy(policy),
+      m_size(0) {
+        if (lanes == 0) {
+            throw std::invalid_argument(_("sharded_mqueue needs at least one lane"));
+        }
+        m_next[internal::PUT_LANE] = m_next[internal::GET_LANE] = 0;
+        for (int i = 0; i < 2; i++) {
+            int err = ::pthread_key_create(&m_lane_key[i], 0);
+            if (err != 0) {
+                if (i > 0) {
+                    ::pthread_key_delete(m_lane_key[0]);
+                }
+                throw std::runtime_error(_("pthread_key_create error") + std::string(" -- ") + strerror(err));
+            }
+        }
+    }
+    ~sharded_mqueue() {
+        ::pthread_key_delete(m_lane_key[internal::PUT_LANE]);
+        ::pthread_key_delete(m_lane_key[internal::GET_LANE]);
+    }
+    /**
+     * pin the calling thread to lane % lanes() in every sharded_mqueue,
+     * for its puts and its gets.
+     */
+    static void pin(size_t lane) {
+        internal::thread_lane(internal::PUT_LANE) = lane;
+        internal::thread_lane(internal::GET_LANE) = lane;
+    }
+    size_t lanes(void) const {
+        return m_nLanes;
+    }
+    size_t size(void) const {
+        return __atomic_load_n(&m_size, __ATOMIC_RELAXED);
+    }
+    T get(void) {
+        T item;
+        T* oit = &item;
+        fetch(oit, 1, 0);
+        return item;
+    }
+    template <typename OutputIterator>
+    size_t get(OutputIterator oit, size_t n) {
+        return fetch(oit, n, 0);
+    }
+    template <typename Carrier>
+    void get(size_t n, Carrier* carrier) {
+        assert(carrier != 0);
+        carrier->clear();
+        std::back_insert_iterator<Carrier> oit(*carrier);
+        fetch(oit, n, 0);
+        return;
+    }
+    bool timed_get(unsigned usecs, T* item) {
+        assert(item != 0);
+        deadline until(usecs);
+        return fetch(item, 1, &until) > 0;
+    }
+    template <typename Carrier>
+    bool timed_get(unsigned usecs, size_t n, Carrier* carrier) {
+        assert(carrier != 0);
+        carrier->clear();
+        deadline until(usecs);
+        std::back_insert_iterator<Carrier> oit(*carrier);
+        return fetch(oit, n, &until) > 0;
+    }
+    template <typename OutputIterator>
+    bool timed_get(unsigned usecs, OutputIterator oit, size_t n, size_t* m = 0) {
+        deadline until(usecs);
+        size_t i = fetch(oit, n, &until);
+        if (m) *m = i;
+        return i > 0;
+    }
+    void put(const T& item) {
+        reserve(1, 0);
+        push(&item, &item + 1);
+        return;
+    }
+    bool timed_put(unsigned usecs, const T& item) {
+        deadline until(usecs);
+        if (!reserve(1, &until)) {
+            return false;
+        }
+        push(&item, &item + 1);
+        return true;
+    }
+#ifdef XD_HAVE_CXX11
+    void put(T&& item) {
+        reserve(1, 0);
+        push(std::make_move_iterator(&item), std::make_move_iterator(&item + 1));
+        return;
+    }
+    bool timed_put(unsigned usecs, T&& item) {
+        deadline until(usecs);
+        if (!reserve(1, &until)) {
+            return false;
+        }
+        push(std::make_move_iterator(&item), std::make_move_iterator(&item + 1));
+        return true;
+    }
+#endif
+    template <typename Carrier>
+    void put(const Carrier& carrier) {
+        put(carrier.begin(), carrier.end());
+        return;
+    }
+    /**
+     * like mqueue, waits only for the total to be under volumn.
+     */
+    template <typename InputIterator>
+    void put(InputIterator first, InputIterator last) {
+        std::vector<T> batch(first, last);
+        if (batch.empty()) {
+            return;
+        }
+        reserve(batch.size(), 0);
+        push(batch.begin(), batch.end());
+        return;
+    }
+    template <typename InputIterator>
+    bool timed_put(unsigned usecs, InputIterator first, InputIterator last) {
+        deadline until(usecs);
+        std::vector<T> batch(first, last);
+        if (batch.empty()) {
+            return true;
+        }
+        if (!reserve(batch.size(), &until)) {
+            return false;
+        }
+        push(batch.begin(), batch.end());
+        return true;
+    }
+
+  private:
+    struct lane {
+        lane(): count(0) {
+        }
+        IceUtil::Mutex mutex;
+        std::deque<T> queue;
+        size_t count;           // queue.size(), readable without mutex
+        char pad[XD_CACHELINE_SIZE];
+    };
+
+  private:
+    // the pinned lane, or the one this queue gave the thread at first use
+    size_t home(internal::lane_role role) {
+        size_t lane = internal::thread_lane(role);
+        if (lane == std::numeric_limits<size_t>::max()) {
+            void* slot = ::pthread_getspecific(m_lane_key[role]);
+            if (slot == 0) {
+                lane = __atomic_fetch_add(&m_next[role], 1, __ATOMIC_RELAXED);
+                ::pthread_setspecific(m_lane_key[role], reinterpret_cast<void*>(lane + 1));
+            }
+            else {
+                lane = reinterpret_cast<size_t>(slot) - 1;
+            }
+        }
+        return lane % m_nLanes;
+    }
+    /**
+     * count m_size up by n once it is under m_volumn.
+     */
+    bool reserve(size_t n, const deadline* until) {
+        for (;;) {
+            size_t cur = __atomic_load_n(&m_size, __ATOMIC_RELAXED);
+            if (cur < m_volumn) {
+                if (__atomic_compare_exchange_n(&m_size, &cur, cur + n, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    return true;
+                }
+                continue;
+            }
+            int ticket = m_forNotFull.prepare_wait();
+            if (__atomic_load_n(&m_size, __ATOMIC_SEQ_CST) < m_volumn) {
+                m_forNotFull.cancel_wait();
+                continue;
+            }
+            if (!m_forNotFull.wait(ticket, m_policy, until)) {
+                return false;
+            }
+        }
+    }
+    void release(size_t n) {
+        __atomic_sub_fetch(&m_size, n, __ATOMIC_RELAXED);
+        m_forNotFull.notify(n);
+    }
+    template <typename InputIterator>
+    void push(InputIterator first, InputIterator last) {
+        lane& l = m_lanes[home(internal::PUT_LANE)];
+        size_t n;
+        {
+            IceUtil::Mutex::Lock lock(l.mutex);
+            size_t before = l.queue.size();
+            l.queue.insert(l.queue.end(), first, last);
+            n = l.queue.size() - before;
+            __atomic_store_n(&l.count, l.queue.size(), __ATOMIC_RELEASE);
+        }
+        m_forNotEmpty.notify(n);
+    }
+    /**
+     * get up to n items, home lane first, then steal; parks when all the
+     * lanes are dry.  returns 0 only when until passed.
+     */
+    template <typename OutputIterator>
+    size_t fetch(OutputIterator& oit, size_t n, const deadline* until) {
+        size_t i;
+        for (;;) {
+            if ((i = scan(oit, n)) > 0 || n == 0) {
+                break;
+            }
+            if (poll()) {
+                continue;
+            }
+            int ticket = m_forNotEmpty.prepare_wait();
+            if ((i = scan(oit, n)) > 0) {
+                m_forNotEmpty.cancel_wait();
+                break;
+            }
+            if (!m_forNotEmpty.wait(ticket, m_policy, until)) {
+                i = scan(oit, n);
+                break;
+            }
+        }
+        if (i > 0) {
+            release(i);
+        }
+        return i;
+    }
+    template <typename OutputIterator>
+    size_t scan(OutputIterator& oit, size_t n) {
+        size_t h = home(internal::GET_LANE);
+        size_t i = take(m_lanes[h], oit, n);
+        for (size_t k = 1; i == 0 && k < m_nLanes; k++) {
+            i = steal(m_lanes[(h + k) % m_nLanes], m_lanes[h], oit, n);
+        }
+        return i;
+    }
+    template <typename OutputIterator>
+    size_t take(lane& l, OutputIterator& oit, size_t n) {
+        if (__atomic_load_n(&l.count, __ATOMIC_ACQUIRE) == 0) {
+            return 0;
+        }
+        IceUtil::Mutex::Lock lock(l.mutex);
+        size_t i;
+        for (i = 0; i < n && !l.queue.empty(); i++) {
+            *oit = XD_MOVE(l.queue.front());
+            oit++;
+            l.queue.pop_front();
+        }
+        __atomic_store_n(&l.count, l.queue.size(), __ATOMIC_RELEASE);
+        return i;
+    }
+    /**
+     * take up to n from victim, and move what is left of half its lane
+     * over to the home lane.
+     */
+    template <typename OutputIterator>
+    size_t steal(lane& victim, lane& mine, OutputIterator& oit, size_t n) {
+        if (__atomic_load_n(&victim.count, __ATOMIC_ACQUIRE) == 0) {
+            return 0;
+        }
+        std::vector<T> spare;
+        size_t i;
+        {
+            IceUtil::Mutex::Lock lock(victim.mutex);
+            size_t half = (victim.queue.size() + 1) / 2;
+            for (i = 0; i < n && !victim.queue.empty(); i++) {
+                *oit = XD_MOVE(victim.queue.front());
+                oit++;
+                victim.queue.pop_front();
+            }
+            while (i + spare.size() < half && !victim.queue.empty()) {
+                spare.push_back(XD_MOVE(victim.queue.front()));
+                victim.queue.pop_front();
+            }
+            __atomic_store_n(&victim.count, victim.queue.size(), __ATOMIC_RELEASE);
+        }
+        if (!spare.empty()) {
+            IceUtil::Mutex::Lock lock(mine.mutex);
+#ifdef XD_HAVE_CXX11
+            mine.queue.insert(mine.queue.end(), std::make_move_iterator(spare.begin()),
+                              std::make_move_iterator(spare.end()));
+#else
+            mine.queue.insert(mine.queue.end(), spare.begin(), spare.end());
+#endif
+            __atomic_store_n(&mine.count, mine.queue.size(), __ATOMIC_RELEASE);
+        }
+        // a consumer may have found every lane dry while spare was in none
+        if (!spare.empty()) {
+            m_forNotEmpty.notify(spare.size());
+        }
+        return i;
+    }
+    // spin/yield per m_policy until some lane looks non-empty
+    bool poll(void) const {
+        for (unsigned i = 0; i < m_policy.spins + m_policy.yields; i++) {
+            if (__atomic_load_n(&m_size, __ATOMIC_RELAXED) > 0) {
+                for (size_t k = 0; k < m_nLanes; k++) {
+                    if (__atomic_load_n(&m_lanes[k].count, __ATOMIC_ACQUIRE) > 0) {
+                        return true;
+                    }
+                }
+            }
+            if (i < m_policy.spins) {
+                XD_CPU_RELAX();
+            }
+            else {
+                sched_yield();
+            }
+        }
+        return false;
+    }
+
+  private:
+    // non-copyable
+    sharded_mqueue(const sharded_mqueue&);
+    sharded_mqueue& operator=(const sharded_mqueue&);
+
+  private:
+    const size_t m_nLanes;
+    scoped_array<lane> m_lanes;
+    const size_t m_volumn;
+    wait_policy m_policy;
+    pthread_key_t m_lane_key[2];    // a thread's lane per role, plus one
+    size_t m_next[2];               // lanes handed out per role
+
+    char m_pad0[XD_CACHELINE_SIZE];
+    size_t m_size;              // items in all lanes, reserved by put
+
+    char m_pad1[XD_CACHELINE_SIZE - sizeof(size_t)];
+    waitqueue m_forNotFull;
+    waitqueue m_forNotEmpty;
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_SHARDED_MQUEUE_H__
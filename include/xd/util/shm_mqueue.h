@@ -0,0 +1,487 @@
+#ifndef __XD_UTIL_SHM_MQUEUE_H__
+#define __XD_UTIL_SHM_MQUEUE_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include <xd/topdef.h>
+#include <xd/util/deadline.h>
+#include <xd/util/waitqueue.h>
+
+namespace xd { namespace util {
+
+/**
+ * shm_peer_dead
+ *  Thrown by a shm_mqueue call which found that a process attached to the
+ *  other end exited without detaching.  Its slot is reclaimed, so the
+ *  call may be retried once the peer is restarted.
+ */
+class shm_peer_dead: public std::runtime_error {
+  public:
+    explicit shm_peer_dead(const std::string& what): std::runtime_error(what) {
+    }
+};
+
+namespace internal {
+
+struct shm_peer {
+    int32_t pid;
+    int32_t role;
+    int32_t waiting[2];         // its waits on forNotEmpty, forNotFull
+};
+
+/**
+ * shm_header
+ *  The first page of the segment, the byte ring follows it.  head/tail
+ *  count bytes consumed/produced and only grow; they are advanced under
+ *  mutex after a record is completely written or read, so a process dying
+ *  mid-copy leaves the ring as it was before the call.
+ */
+struct shm_header {
+    static const uint32_t MAGIC = 0x78647173;       // "xdqs"
+    static const uint32_t VERSION = 3;
+    static const unsigned MAX_PEERS = 64;
+
+    uint32_t magic;             // set last, once the rest is initialized
+    uint32_t version;
+    uint64_t volumn;            // bytes of the ring, a power of two
+    uint64_t head;
+    uint64_t tail;
+    pthread_mutex_t mutex;      // process-shared and robust
+    waitqueue forNotEmpty;
+    waitqueue forNotFull;
+    uint32_t deaths[2];         // producers, consumers found dead so far
+    shm_peer peers[MAX_PEERS];
+};
+
+}  // namespace internal
+
+/**
+ * shm_mqueue
+ *  mqueue of byte records between processes on one host.  The queue
+ *  lives in a shm_open(3) segment when name is like "/name", or in an
+ *  mmap(2)ed file otherwise, and is created by whichever process comes
+ *  first; later ones attach to it and volumn is then taken from the
+ *  segment.  Records are length prefixed, so fixed-size structs and
+ *  variable-length blobs share one layout; a record may be up to half the
+ *  ring.  Waits park on process-shared futexes.
+ *
+ *      xd::util::shm_mqueue q("/ingest", 64 << 20, xd::util::shm_mqueue::PRODUCER);
+ *      q.put(buf, len);
+ *
+ *  Each process registers its pid and role.  A blocked caller looks every
+ *  PEER_CHECK_INTERVAL for registered processes of the other role which
+ *  are gone, and throws shm_peer_dead once for each such death since it
+ *  attached, whichever process found it; a process which
+ *  dies holding the mutex is recovered through the robust mutex, and the
+ *  waits of one which dies parked are taken off the waitqueues.  The
+ *  segment is set up under an flock(2), so one whose creator died half
+ *  way is initialized again by the next process to open it.  The
+ *  segment outlives the processes, remove it with shm_mqueue::unlink().
+ *  Link with -lrt on glibc older than 2.17 for shm_open.
+ */
+class shm_mqueue {
+  public:
+    enum role {
+        PRODUCER = 1,
+        CONSUMER = 2,
+        BOTH = PRODUCER | CONSUMER
+    };
+    static const size_t DATA_OFFSET = 4096;
+    static const unsigned PEER_CHECK_INTERVAL = 200 * 1000;     // usecs
+    static const unsigned ATTACH_TIMEOUT = 5 * 1000 * 1000;     // usecs
+
+  public:
+    shm_mqueue(const std::string& name, size_t volumn, role r,
+               const wait_policy& policy = wait_policy()):
+      m_name(name),
+      m_role(r),
+      m_policy(policy),
+      m_header(0),
+      m_data(0),
+      m_length(0),
+      m_slot(0) {
+        m_deaths[0] = m_deaths[1] = 0;
+        open(round_up(volumn));
+        try {
+            attach();
+        }
+        catch (...) {
+            ::munmap(m_header, m_length);
+            throw;
+        }
+    }
+    ~shm_mqueue() {
+        try {
+            detach();
+        }
+        catch (...) {
+            // NOTHING
+        }
+        ::munmap(m_header, m_length);
+    }
+    static void unlink(const std::string& name) {
+        if (is_file(name)) {
+            ::unlink(name.c_str());
+        }
+        else {
+            ::shm_unlink(name.c_str());
+        }
+    }
+    size_t volumn(void) const {
+        return m_header->volumn;
+    }
+    // the largest record put() takes
+    size_t max_record(void) const {
+        return m_header->volumn / 2 - sizeof(uint32_t);
+    }
+    // bytes in the ring, record headers and padding included
+    size_t size(void) const {
+        uint64_t tail = __atomic_load_n(&m_header->tail, __ATOMIC_ACQUIRE);
+        return tail - __atomic_load_n(&m_header->head, __ATOMIC_ACQUIRE);
+    }
+    void put(const void* data, size_t len) {
+        guard lock(this);
+        write(lock, data, len, 0);
+        return;
+    }
+    void put(const std::string& record) {
+        put(record.data(), record.size());
+        return;
+    }
+    bool timed_put(unsigned usecs, const void* data, size_t len) {
+        deadline until(usecs);
+        guard lock(this);
+        return write(lock, data, len, &until);
+    }
+    bool timed_put(unsigned usecs, const std::string& record) {
+        return timed_put(usecs, record.data(), record.size());
+    }
+    void get(std::string* record) {
+        assert(record != 0);
+        guard lock(this);
+        read(lock, record, 0);
+        return;
+    }
+    std::string get(void) {
+        std::string record;
+        get(&record);
+        return record;
+    }
+    bool timed_get(unsigned usecs, std::string* record) {
+        assert(record != 0);
+        deadline until(usecs);
+        guard lock(this);
+        return read(lock, record, &until);
+    }
+
+  private:
+    static const uint32_t SKIP = 0xffffffff;    // rest of the ring is padding
+
+    // m_header->mutex, recovering it from a holder which died
+    class guard {
+      public:
+        explicit guard(shm_mqueue* queue): m_queue(queue), m_acquired(false) {
+            acquire();
+        }
+        ~guard() {
+            if (m_acquired) {
+                release();
+            }
+        }
+        void acquire(void) {
+            int err = pthread_mutex_lock(&m_queue->m_header->mutex);
+            if (err == EOWNERDEAD) {
+                m_queue->reap();
+                pthread_mutex_consistent(&m_queue->m_header->mutex);
+            }
+            else if (err != 0) {
+                throw std::runtime_error(_("shm_mqueue lock error -- ") + std::string(strerror(err)));
+            }
+            m_acquired = true;
+        }
+        void release(void) {
+            m_acquired = false;
+            pthread_mutex_unlock(&m_queue->m_header->mutex);
+        }
+
+      private:
+        shm_mqueue* m_queue;
+        bool m_acquired;
+    };
+
+  private:
+    static bool is_file(const std::string& name) {
+        return name.find('/', 1) != std::string::npos;
+    }
+    static size_t round_up(size_t volumn) {
+        if (volumn < 64 || volumn > (static_cast<size_t>(1) << 40)) {
+            throw std::invalid_argument(_("bad shm_mqueue volumn, must be in [64, 2^40]"));
+        }
+        size_t n = 64;
+        while (n < volumn) n <<= 1;
+        return n;
+    }
+    static size_t record_size(size_t len) {
+        return (sizeof(uint32_t) + len + 7) & ~static_cast<size_t>(7);
+    }
+    static std::runtime_error error(const std::string& what, const std::string& name, int err) {
+        return std::runtime_error(what + name + " -- " + std::string(strerror(err)));
+    }
+    int open_fd(int flags) const {
+        if (is_file(m_name)) {
+            return ::open(m_name.c_str(), flags, 0600);
+        }
+        return ::shm_open(m_name.c_str(), flags, 0600);
+    }
+    /**
+     * map the segment, creating and initializing it unless it has the
+     * magic, under an exclusive flock(2); the mapping shares fd's open
+     * file, so closing fd alone would not drop the lock.
+     */
+    void open(size_t volumn) {
+        int fd = open_fd(O_RDWR | O_CREAT);
+        if (fd < 0) {
+            throw error(_("shm_mqueue cannot open "), m_name, errno);
+        }
+        try {
+            open(fd, volumn);
+        }
+        catch (...) {
+            ::flock(fd, LOCK_UN);
+            ::close(fd);
+            throw;
+        }
+        ::flock(fd, LOCK_UN);
+        ::close(fd);
+    }
+    void open(int fd, size_t volumn) {
+        deadline until(ATTACH_TIMEOUT);
+        while (::flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            if (errno != EWOULDBLOCK && errno != EINTR) {
+                throw error(_("shm_mqueue cannot lock "), m_name, errno);
+            }
+            if (until.expired()) {
+                throw std::runtime_error(_("shm_mqueue never initialized -- ") + m_name);
+            }
+            ::usleep(1000);
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            throw error(_("shm_mqueue cannot stat "), m_name, errno);
+        }
+        if (static_cast<size_t>(st.st_size) > DATA_OFFSET) {
+            map(fd, st.st_size);
+            if (__atomic_load_n(&m_header->magic, __ATOMIC_ACQUIRE) == internal::shm_header::MAGIC) {
+                if (m_header->version != internal::shm_header::VERSION ||
+                    DATA_OFFSET + m_header->volumn != m_length) {
+                    ::munmap(m_header, m_length);
+                    throw std::runtime_error(_("shm_mqueue layout mismatch -- ") + m_name);
+                }
+                return;
+            }
+            // its creator died before setting the magic
+            ::munmap(m_header, m_length);
+        }
+        if (::ftruncate(fd, DATA_OFFSET + volumn) != 0) {
+            throw error(_("shm_mqueue cannot size "), m_name, errno);
+        }
+        map(fd, DATA_OFFSET + volumn);
+        init(volumn);
+    }
+    void map(int fd, size_t length) {
+        void* addr = ::mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            throw error(_("shm_mqueue cannot map "), m_name, errno);
+        }
+        m_length = length;
+        m_header = static_cast<internal::shm_header*>(addr);
+        m_data = static_cast<char*>(addr) + DATA_OFFSET;
+    }
+    void init(size_t volumn) {
+        m_header->version = internal::shm_header::VERSION;
+        m_header->volumn = volumn;
+        m_header->head = 0;
+        m_header->tail = 0;
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&m_header->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        new (&m_header->forNotEmpty) waitqueue(true);
+        new (&m_header->forNotFull) waitqueue(true);
+        memset(m_header->deaths, 0, sizeof(m_header->deaths));
+        memset(m_header->peers, 0, sizeof(m_header->peers));
+        __atomic_store_n(&m_header->magic, internal::shm_header::MAGIC, __ATOMIC_RELEASE);
+    }
+    void attach(void) {
+        guard lock(this);
+        reap();
+        // deaths before we came are not ours to report
+        m_deaths[0] = m_header->deaths[0];
+        m_deaths[1] = m_header->deaths[1];
+        for (unsigned i = 0; i < internal::shm_header::MAX_PEERS; i++) {
+            if (m_header->peers[i].pid == 0) {
+                m_header->peers[i].pid = ::getpid();
+                m_header->peers[i].role = m_role;
+                m_header->peers[i].waiting[0] = 0;
+                m_header->peers[i].waiting[1] = 0;
+                m_slot = i;
+                return;
+            }
+        }
+        throw std::runtime_error(_("shm_mqueue has too many processes attached -- ") + m_name);
+    }
+    void detach(void) {
+        guard lock(this);
+        if (m_header->peers[m_slot].pid == ::getpid()) {
+            m_header->peers[m_slot].pid = 0;
+        }
+    }
+    /**
+     * free the slots of processes which are gone, end the waits they left
+     * and count their deaths by role, for every attached process to see,
+     * mutex held.
+     */
+    void reap(void) {
+        for (unsigned i = 0; i < internal::shm_header::MAX_PEERS; i++) {
+            internal::shm_peer& peer = m_header->peers[i];
+            if (peer.pid != 0 && ::kill(peer.pid, 0) != 0 && errno == ESRCH) {
+                if (peer.role & PRODUCER) {
+                    m_header->deaths[0]++;
+                }
+                if (peer.role & CONSUMER) {
+                    m_header->deaths[1]++;
+                }
+                peer.pid = 0;
+                m_header->forNotEmpty.cancel_wait(peer.waiting[0]);
+                m_header->forNotFull.cancel_wait(peer.waiting[1]);
+                peer.waiting[0] = 0;
+                peer.waiting[1] = 0;
+            }
+        }
+    }
+    /**
+     * throws if a process of the other end died since the last check,
+     * whoever found it, mutex held.
+     */
+    void check_peers(void) {
+        reap();
+        bool dead = false;
+        if ((m_role & CONSUMER) && m_header->deaths[0] != m_deaths[0]) {
+            dead = true;
+        }
+        if ((m_role & PRODUCER) && m_header->deaths[1] != m_deaths[1]) {
+            dead = true;
+        }
+        m_deaths[0] = m_header->deaths[0];
+        m_deaths[1] = m_header->deaths[1];
+        if (dead) {
+            throw shm_peer_dead(_("shm_mqueue peer died -- ") + m_name);
+        }
+    }
+    /**
+     * park on wq with the mutex released, waking every PEER_CHECK_INTERVAL
+     * to look for dead peers.  false only if until passed.
+     */
+    bool wait(waitqueue& wq, guard& lock, const deadline* until) {
+        deadline check(PEER_CHECK_INTERVAL);
+        bool checking = (until == 0 || check.remaining() < until->remaining());
+        // counted in the slot after the waitqueue and uncounted before it,
+        // so that reap() never ends more waits than are left
+        int32_t* waiting = &m_header->peers[m_slot].waiting[&wq == &m_header->forNotEmpty ? 0 : 1];
+        int ticket = wq.prepare_wait();
+        __atomic_add_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+        lock.release();
+        bool waited = wq.park(ticket, m_policy, checking ? &check : until);
+        __atomic_sub_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+        wq.cancel_wait();
+        lock.acquire();
+        if (!waited && checking) {
+            check_peers();
+            return true;
+        }
+        return waited;
+    }
+    bool write(guard& lock, const void* data, size_t len, const deadline* until) {
+        size_t need = record_size(len);
+        if (len > max_record()) {
+            throw std::invalid_argument(_("shm_mqueue record larger than half the volumn"));
+        }
+        uint64_t volumn = m_header->volumn;
+        uint64_t pos;
+        uint64_t room;
+        for (;;) {
+            pos = m_header->tail & (volumn - 1);
+            room = (volumn - pos < need) ? volumn - pos + need : need;
+            if (volumn - (m_header->tail - m_header->head) >= room) {
+                break;
+            }
+            if (!wait(m_header->forNotFull, lock, until)) {
+                return false;
+            }
+        }
+        if (room > need) {
+            *reinterpret_cast<uint32_t*>(m_data + pos) = SKIP;
+            pos = 0;
+        }
+        *reinterpret_cast<uint32_t*>(m_data + pos) = static_cast<uint32_t>(len);
+        memcpy(m_data + pos + sizeof(uint32_t), data, len);
+        __atomic_store_n(&m_header->tail, m_header->tail + room, __ATOMIC_RELEASE);
+        m_header->forNotEmpty.notify(1);
+        return true;
+    }
+    bool read(guard& lock, std::string* record, const deadline* until) {
+        while (m_header->tail == m_header->head) {
+            if (!wait(m_header->forNotEmpty, lock, until)) {
+                return false;
+            }
+        }
+        uint64_t volumn = m_header->volumn;
+        uint64_t pos = m_header->head & (volumn - 1);
+        uint64_t skipped = 0;
+        if (*reinterpret_cast<uint32_t*>(m_data + pos) == SKIP) {
+            skipped = volumn - pos;
+            pos = 0;
+        }
+        uint32_t len = *reinterpret_cast<uint32_t*>(m_data + pos);
+        record->assign(m_data + pos + sizeof(uint32_t), len);
+        __atomic_store_n(&m_header->head, m_header->head + skipped + record_size(len), __ATOMIC_RELEASE);
+        m_header->forNotFull.notify(1);
+        return true;
+    }
+
+  private:
+    // non-copyable
+    shm_mqueue(const shm_mqueue&);
+    shm_mqueue& operator=(const shm_mqueue&);
+
+  private:
+    const std::string m_name;
+    const role m_role;
+    wait_policy m_policy;
+    internal::shm_header* m_header;
+    char* m_data;
+    size_t m_length;
+    unsigned m_slot;            // ours in m_header->peers
+    uint32_t m_deaths[2];       // m_header->deaths when last checked
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_SHM_MQUEUE_H__
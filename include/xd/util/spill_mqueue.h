@@ -0,0 +1,461 @@
+#ifndef __XD_UTIL_SPILL_MQUEUE_H__
+#define __XD_UTIL_SPILL_MQUEUE_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <IceUtil/Mutex.h>
+
+#include <cassert>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <xd/topdef.h>
+#ifdef XD_HAVE_CXX11
+#   include <type_traits>
+#endif
+#include <xd/util/deadline.h>
+#include <xd/util/fsrouter.h>
+#include <xd/util/waitqueue.h>
+
+namespace xd { namespace util {
+
+/**
+ * spill_codec
+ *  How spill_mqueue writes an item to disk and reads it back.  The
+ *  primary template copies the bytes of a trivially copyable T; give your
+ *  own Codec with the same two members for anything else.
+ */
+template <typename T>
+struct spill_codec {
+#ifdef XD_HAVE_CXX11
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "spill_codec<T> copies bytes, give spill_mqueue a Codec for this T");
+#endif
+    static void encode(const T& item, std::string* out) {
+        out->append(reinterpret_cast<const char*>(&item), sizeof(T));
+    }
+    static bool decode(const char* data, size_t len, T* item) {
+        if (len != sizeof(T)) {
+            return false;
+        }
+        memcpy(item, data, sizeof(T));
+        return true;
+    }
+};
+
+template <>
+struct spill_codec<std::string> {
+    static void encode(const std::string& item, std::string* out) {
+        out->append(item);
+    }
+    static bool decode(const char* data, size_t len, std::string* item) {
+        item->assign(data, len);
+        return true;
+    }
+};
+
+namespace internal {
+
+/**
+ * spill_segment
+ *  One append-only segment file, mapped whole.  Records are a uint32
+ *  length and the encoded item, written from end and read from pos.
+ */
+class spill_segment {
+  public:
+    static const int MAX_NAME_TRIES = 1000;
+
+  public:
+    /**
+     * creates the next of router's names which is not taken, another
+     * queue spilling to the same dir and prefix may have its own router.
+     */
+    spill_segment(fsrouter* router, size_t length):
+      m_fd(-1),
+      m_base(0),
+      m_length(length),
+      m_end(0),
+      m_pos(0) {
+        for (int tries = 1; m_fd < 0; tries++) {
+            m_path = router->spawn();
+            m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (m_fd < 0 && (errno != EEXIST || tries == MAX_NAME_TRIES)) {
+                fail(_("spill segment open error -- "), errno);
+            }
+        }
+        // reserve the blocks now, a full disk must not SIGBUS a later store
+        int err = ::posix_fallocate(m_fd, 0, length);
+        if (err != 0) {
+            fail(_("spill segment allocate error -- "), err);
+        }
+        void* addr = ::mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        if (addr == MAP_FAILED) {
+            fail(_("spill segment map error -- "), errno);
+        }
+        m_base = static_cast<char*>(addr);
+        ::madvise(m_base, m_length, MADV_SEQUENTIAL);
+    }
+    ~spill_segment() {
+        ::munmap(m_base, m_length);
+        ::close(m_fd);
+        ::unlink(m_path.c_str());
+    }
+    bool fits(size_t len) const {
+        return m_length - m_end >= sizeof(uint32_t) + len;
+    }
+    void append(const std::string& record) {
+        uint32_t len = static_cast<uint32_t>(record.size());
+        memcpy(m_base + m_end, &len, sizeof(len));
+        memcpy(m_base + m_end + sizeof(len), record.data(), record.size());
+        m_end += sizeof(len) + record.size();
+    }
+    // start the sequential write-back of a segment which is complete
+    void seal(void) {
+        ::sync_file_range(m_fd, 0, m_end, SYNC_FILE_RANGE_WRITE);
+    }
+    bool exhausted(void) const {
+        return m_pos == m_end;
+    }
+    // where the next record to read is
+    size_t pos(void) const {
+        return m_pos;
+    }
+    /**
+     * the record at *pos, valid until the segment is destroyed, moving
+     * *pos past it; 0 past the end.
+     */
+    const char* record(size_t* pos, size_t* len) const {
+        if (*pos == m_end) {
+            return 0;
+        }
+        uint32_t n;
+        memcpy(&n, m_base + *pos, sizeof(n));
+        const char* data = m_base + *pos + sizeof(n);
+        *pos += sizeof(n) + n;
+        *len = n;
+        return data;
+    }
+    // marks the next record read
+    void pass(void) {
+        size_t len;
+        record(&m_pos, &len);
+    }
+
+  private:
+    // throw from the constructor, removing what it made so far
+    void fail(const char* what, int err) {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            ::unlink(m_path.c_str());
+        }
+        throw std::runtime_error(what + m_path + " -- " + std::string(strerror(err)));
+    }
+
+  private:
+    // non-copyable
+    spill_segment(const spill_segment&);
+    spill_segment& operator=(const spill_segment&);
+
+  private:
+    std::string m_path;
+    int m_fd;
+    char* m_base;
+    const size_t m_length;
+    size_t m_end;
+    size_t m_pos;
+};
+
+}  // namespace internal
+
+/**
+ * spill_mqueue
+ *  Unbounded mqueue which keeps up to memory_volumn items in memory and
+ *  spills the rest to append-only segment files named by router, so a
+ *  downstream outage costs disk instead of blocking capture or growing
+ *  the heap.  Once spilling starts every put goes to disk until the
+ *  consumers have read the spill back, in refill batches, so the order
+ *  stays FIFO.  put() never waits.
+ *
+ *      xd::util::spill_mqueue<std::string> q(xd::util::fsrouter("/data/spill", "ingest", "spill"),
+ *                                           100000);
+ *
+ *  Segments are segment_size bytes, preallocated and mapped, and written
+ *  strictly sequentially; each is handed to write-back when full and
+ *  unlinked once read.  They do not survive the process, this is an
+ *  overflow and not a journal.
+ */
+template <typename T, typename Codec = spill_codec<T> >
+class spill_mqueue {
+  public:
+    static const size_t DEFAULT_SEGMENT_SIZE = 64 * 1024 * 1024;
+    static const size_t REFILL_BATCH = 4096;
+
+  public:
+    spill_mqueue(const fsrouter& router, size_t memory_volumn,
+                 size_t segment_size = DEFAULT_SEGMENT_SIZE,
+                 const wait_policy& policy = wait_policy()):
+      m_router(router),
+      m_memory_volumn(memory_volumn),
+      m_segment_size(segment_size),
+      m_policy(policy),
+      m_nSpilled(0),
+      m_refilling(false) {
+        if (memory_volumn == 0) {
+            throw std::invalid_argument(_("spill_mqueue needs room for one item in memory"));
+        }
+    }
+    ~spill_mqueue() {
+        while (!m_segments.empty()) {
+            delete m_segments.front();
+            m_segments.pop_front();
+        }
+    }
+    size_t size(void) const {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        return m_queue.size() + m_nSpilled;
+    }
+    // items on disk
+    size_t spilled(void) const {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        return m_nSpilled;
+    }
+    void put(const T& item) {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        if (m_nSpilled == 0 && m_queue.size() < m_memory_volumn) {
+            m_queue.push_back(item);
+        }
+        else {
+            spill(item);
+        }
+        m_forNotEmpty.notify(1);
+        return;
+    }
+    template <typename InputIterator>
+    void put(InputIterator first, InputIterator last) {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        size_t n = 0;
+        for (; first != last; ++first, n++) {
+            if (m_nSpilled == 0 && m_queue.size() < m_memory_volumn) {
+                m_queue.push_back(*first);
+            }
+            else {
+                spill(*first);
+            }
+        }
+        m_forNotEmpty.notify(n);
+        return;
+    }
+    T get(void) {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        wait_for_not_empty(lock, 0);
+        T item(XD_MOVE(m_queue.front()));
+        m_queue.pop_front();
+        return item;
+    }
+    bool timed_get(unsigned usecs, T* item) {
+        assert(item != 0);
+        deadline until(usecs);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        if (!wait_for_not_empty(lock, &until)) {
+            return false;
+        }
+        *item = XD_MOVE(m_queue.front());
+        m_queue.pop_front();
+        return true;
+    }
+    template <typename OutputIterator>
+    size_t get(OutputIterator oit, size_t n) {
+        IceUtil::Mutex::Lock lock(m_mutex);
+        wait_for_not_empty(lock, 0);
+        return take(oit, n);
+    }
+    template <typename OutputIterator>
+    bool timed_get(unsigned usecs, OutputIterator oit, size_t n, size_t* m = 0) {
+        deadline until(usecs);
+        IceUtil::Mutex::Lock lock(m_mutex);
+        if (!wait_for_not_empty(lock, &until)) {
+            return false;
+        }
+        size_t i = take(oit, n);
+        if (m) *m = i;
+        return true;
+    }
+
+  private:
+    /**
+     * refill from disk first, park only when there is nothing anywhere or
+     * another consumer is refilling.
+     */
+    bool wait_for_not_empty(IceUtil::Mutex::Lock& lock, const deadline* until) {
+        for (;;) {
+            if (!m_queue.empty()) {
+                return true;
+            }
+            if (m_nSpilled > 0 && !m_refilling) {
+                refill(lock);
+                continue;
+            }
+            int ticket = m_forNotEmpty.prepare_wait();
+            lock.release();
+            bool waited = m_forNotEmpty.wait(ticket, m_policy, until);
+            lock.acquire();
+            if (!waited) {
+                if (m_queue.empty() && m_nSpilled > 0 && !m_refilling) {
+                    refill(lock);
+                }
+                return !m_queue.empty();
+            }
+        }
+    }
+    template <typename OutputIterator>
+    size_t take(OutputIterator oit, size_t n) {
+        size_t i;
+        for (i = 0; i < n && !m_queue.empty(); i++) {
+            *oit = XD_MOVE(m_queue.front());
+            oit++;
+            m_queue.pop_front();
+        }
+        return i;
+    }
+    void spill(const T& item) {
+        m_record.clear();
+        Codec::encode(item, &m_record);
+        if (m_segments.empty() || !m_segments.back()->fits(m_record.size())) {
+            if (!m_segments.empty()) {
+                m_segments.back()->seal();
+            }
+            size_t length = m_segment_size;
+            if (length < sizeof(uint32_t) + m_record.size()) {
+                length = sizeof(uint32_t) + m_record.size();
+            }
+            m_segments.push_back(new internal::spill_segment(&m_router, length));
+        }
+        m_segments.back()->append(m_record);
+        m_nSpilled++;
+    }
+    /**
+     * read up to REFILL_BATCH items back into memory, in file order, and
+     * drop the segments read to the end by the refill before.  The records
+     * are only picked under the lock, they are decoded without it, by one
+     * consumer at a time so that the batches are spliced in order.  A
+     * record which does not decode stops the batch there: the items before
+     * it are spliced, it is dropped, and the rest stay on disk.
+     */
+    void refill(IceUtil::Mutex::Lock& lock) {
+        std::vector<internal::spill_segment*> done;
+        while (m_segments.front()->exhausted()) {
+            done.push_back(m_segments.front());
+            m_segments.pop_front();
+        }
+        std::vector<std::pair<const char*, size_t> > records;
+        size_t k = 0;
+        size_t pos = m_segments[k]->pos();
+        while (records.size() < REFILL_BATCH && records.size() < m_nSpilled) {
+            size_t len;
+            const char* data = m_segments[k]->record(&pos, &len);
+            if (data == 0) {
+                pos = m_segments[++k]->pos();
+                continue;
+            }
+            records.push_back(std::make_pair(data, len));
+        }
+        m_refilling = true;
+        lock.release();
+
+        std::deque<T> batch;
+        size_t n = 0;       // records consumed
+        bool bad = false;
+        try {
+            while (!bad && n < records.size()) {
+                batch.push_back(T());
+                bad = !Codec::decode(records[n].first, records[n].second, &batch.back());
+                n++;
+            }
+        }
+        catch (...) {
+            // decode threw, rather than push_back
+            if (batch.size() > n) {
+                batch.pop_back();
+                n++;
+            }
+            splice(lock, &batch, n, &done);
+            throw;
+        }
+        if (bad) {
+            batch.pop_back();
+        }
+        splice(lock, &batch, n, &done);
+        if (bad) {
+            throw std::runtime_error(_("spill_mqueue cannot decode a spilled record"));
+        }
+    }
+    /**
+     * ends a refill which consumed n records, retaking the lock.  Wakes
+     * everyone, the consumers parked while it ran may find records left on
+     * disk.
+     */
+    void splice(IceUtil::Mutex::Lock& lock, std::deque<T>* batch, size_t n,
+                std::vector<internal::spill_segment*>* done) {
+        for (size_t i = 0; i < done->size(); i++) {
+            delete (*done)[i];
+        }
+        lock.acquire();
+#ifdef XD_HAVE_CXX11
+        m_queue.insert(m_queue.end(), std::make_move_iterator(batch->begin()),
+                       std::make_move_iterator(batch->end()));
+#else
+        m_queue.insert(m_queue.end(), batch->begin(), batch->end());
+#endif
+        for (size_t i = 0, left = n; left > 0;) {
+            if (m_segments[i]->exhausted()) {
+                i++;
+                continue;
+            }
+            m_segments[i]->pass();
+            left--;
+        }
+        m_nSpilled -= n;
+        m_refilling = false;
+        if (m_nSpilled == 0) {
+            while (!m_segments.empty()) {
+                delete m_segments.front();
+                m_segments.pop_front();
+            }
+        }
+        m_forNotEmpty.notify_all();
+    }
+
+  private:
+    // non-copyable
+    spill_mqueue(const spill_mqueue&);
+    spill_mqueue& operator=(const spill_mqueue&);
+
+  private:
+    fsrouter m_router;
+    const size_t m_memory_volumn;
+    const size_t m_segment_size;
+    wait_policy m_policy;
+
+    std::deque<T> m_queue;      // the oldest items, in memory
+    std::deque<internal::spill_segment*> m_segments;
+    size_t m_nSpilled;          // items in m_segments, all newer than m_queue
+    bool m_refilling;           // a consumer is decoding the next batch
+    std::string m_record;       // encoding scratch
+
+    IceUtil::Mutex m_mutex;
+    waitqueue m_forNotEmpty;
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_SPILL_MQUEUE_H__
@@ -0,0 +1,193 @@
+#ifndef __XD_UTIL_SPSC_RING_H__
+#define __XD_UTIL_SPSC_RING_H__
+
+#include <cassert>
+#include <new>
+#include <stdexcept>
+#include <limits>
+
+#include <xd/topdef.h>
+#include <xd/util/mqueue.h>
+#include <xd/util/ring_mqueue.h>
+
+namespace xd { namespace util {
+
+/**
+ * spsc_ring
+ *  Bounded single-producer/single-consumer ring, capacity rounded up to a
+ *  power of two.  The producer owns m_tail and the consumer owns m_head,
+ *  each on its own cache line together with a cached copy of the other
+ *  side's index, so the peer's line is re-read only when the ring looks
+ *  full/empty.
+ *
+ *  Exactly one thread may put and exactly one thread may get.  Use it as
+ *      xd::util::mqueue<T, xd::util::spsc_ring<T> > q(volumn);
+ */
+template <typename T>
+class spsc_ring {
+  public:
+    explicit spsc_ring(size_t volumn):
+      m_mask(round_up(volumn) - 1),
+      m_slots(static_cast<T*>(::operator new(sizeof(T) * (m_mask + 1)))),
+      m_head(0),
+      m_tail_cache(0),
+      m_tail(0),
+      m_head_cache(0) {
+    }
+    ~spsc_ring() {
+        for (size_t i = m_head; i != m_tail; i++) {
+            m_slots[i & m_mask].~T();
+        }
+        ::operator delete(m_slots);
+    }
+    size_t capacity(void) const {
+        return m_mask + 1;
+    }
+    size_t size(void) const {
+        size_t head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+        return __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE) - head;
+    }
+    bool empty(void) const {
+        return size() == 0;
+    }
+    bool full(void) const {
+        return size() > m_mask;
+    }
+    // producer side
+    bool try_put(const T& item) {
+        size_t tail = m_tail;
+        if (tail - m_head_cache > m_mask) {
+            m_head_cache = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+            if (tail - m_head_cache > m_mask) {
+                return false;
+            }
+        }
+        new (&m_slots[tail & m_mask]) T(item);
+        __atomic_store_n(&m_tail, tail + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+#ifdef XD_HAVE_CXX11
+    template <typename... Args>
+    bool try_emplace(Args&&... args) {
+        size_t tail = m_tail;
+        if (tail - m_head_cache > m_mask) {
+            m_head_cache = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+            if (tail - m_head_cache > m_mask) {
+                return false;
+            }
+        }
+        new (&m_slots[tail & m_mask]) T(std::forward<Args>(args)...);
+        __atomic_store_n(&m_tail, tail + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    bool try_put(T&& item) {
+        return try_emplace(std::move(item));
+    }
+#endif
+    template <typename InputIterator>
+    size_t try_put(InputIterator& first, InputIterator last) {
+        size_t tail = m_tail;
+        size_t room = m_mask + 1 - (tail - m_head_cache);
+        if (room == 0) {
+            m_head_cache = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+            room = m_mask + 1 - (tail - m_head_cache);
+        }
+        size_t i = 0;
+        try {
+            for (; i < room && first != last; i++, ++first) {
+                new (&m_slots[(tail + i) & m_mask]) T(*first);
+            }
+        } catch (...) {
+            __atomic_store_n(&m_tail, tail + i, __ATOMIC_RELEASE);
+            throw;
+        }
+        if (i > 0) {
+            __atomic_store_n(&m_tail, tail + i, __ATOMIC_RELEASE);
+        }
+        return i;
+    }
+    // consumer side
+    bool try_get(T* item) {
+        assert(item != 0);
+        size_t head = m_head;
+        if (head == m_tail_cache) {
+            m_tail_cache = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+            if (head == m_tail_cache) {
+                return false;
+            }
+        }
+        T& slot = m_slots[head & m_mask];
+        *item = XD_MOVE(slot);
+        slot.~T();
+        __atomic_store_n(&m_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    template <typename OutputIterator>
+    size_t try_get(OutputIterator& oit, size_t n) {
+        size_t head = m_head;
+        if (m_tail_cache - head < n) {
+            m_tail_cache = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+        }
+        size_t avail = m_tail_cache - head;
+        size_t i = 0;
+        try {
+            for (; i < n && i < avail; i++) {
+                T& slot = m_slots[(head + i) & m_mask];
+                *oit = XD_MOVE(slot);
+                oit++;
+                slot.~T();
+            }
+        } catch (...) {
+            __atomic_store_n(&m_head, head + i, __ATOMIC_RELEASE);
+            throw;
+        }
+        if (i > 0) {
+            __atomic_store_n(&m_head, head + i, __ATOMIC_RELEASE);
+        }
+        return i;
+    }
+
+  private:
+    static size_t round_up(size_t volumn) {
+        if (volumn == 0 || volumn > (std::numeric_limits<size_t>::max() >> 1) + 1) {
+            throw std::invalid_argument(_("bad ring volumn, must be bounded"));
+        }
+        size_t n = 1;
+        while (n < volumn) n <<= 1;
+        return n;
+    }
+
+  private:
+    // non-copyable
+    spsc_ring(const spsc_ring&);
+    spsc_ring& operator=(const spsc_ring&);
+
+  private:
+    // read-only after construction
+    const size_t m_mask;
+    T* const m_slots;
+
+    char m_pad0[XD_CACHELINE_SIZE];
+    size_t m_head;              // written by consumer
+    size_t m_tail_cache;        // consumer's copy of m_tail
+
+    char m_pad1[XD_CACHELINE_SIZE - 2 * sizeof(size_t)];
+    size_t m_tail;              // written by producer
+    size_t m_head_cache;        // producer's copy of m_head
+
+    char m_pad2[XD_CACHELINE_SIZE - 2 * sizeof(size_t)];
+};
+
+template <typename T>
+class mqueue<T, spsc_ring<T> >: public internal::ring_mqueue<T, spsc_ring<T> > {
+  public:
+    explicit mqueue(size_t volumn,
+                    const wait_policy& policy = wait_policy(internal::ring_mqueue<T, spsc_ring<T> >::SPIN_LIMIT)):
+      internal::ring_mqueue<T, spsc_ring<T> >(volumn, policy) {
+    }
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_SPSC_RING_H__
@@ -0,0 +1,139 @@
+#ifndef __XD_UTIL_WAITQUEUE_H__
+#define __XD_UTIL_WAITQUEUE_H__
+
+#include <sched.h>
+
+#include <climits>
+
+#include <xd/topdef.h>
+#include <xd/util/deadline.h>
+#include <xd/util/futex.h>
+
+namespace xd { namespace util {
+
+/**
+ * wait_policy
+ *  How a waiter behaves before it sleeps: spins busy polls, then yields
+ *  sched_yield(2) polls, then a futex park.  wait_policy() parks at once.
+ */
+struct wait_policy {
+    explicit wait_policy(unsigned spins_ = 0, unsigned yields_ = 0):
+      spins(spins_),
+      yields(yields_) {
+    }
+    unsigned spins;
+    unsigned yields;
+};
+
+/**
+ * waitqueue
+ *  Futex-based event count.  A waiter takes a ticket with prepare_wait()
+ *  while its condition is still false, drops its own lock if any, and
+ *  waits on the ticket; notify(n) bumps the sequence and wakes exactly n
+ *  parked waiters, so one item never wakes the whole herd.
+ *
+ *  prepare_wait() and notify() are fully fenced: a notifier which
+ *  published its change before notify() either sees the waiter or the
+ *  waiter sees the change when it re-checks after prepare_wait().
+ *
+ *  A waitqueue placed in shared memory must be built with shared set, so
+ *  it parks on the process-shared futex.
+ */
+class waitqueue {
+  public:
+    explicit waitqueue(bool shared = false): m_seq(0), m_nWaiting(0), m_shared(shared) {
+    }
+    int prepare_wait(void) {
+        __atomic_add_fetch(&m_nWaiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        return __atomic_load_n(&m_seq, __ATOMIC_SEQ_CST);
+    }
+    /**
+     * ends n waits started by prepare_wait(), more than one only for
+     * waiters which cannot end theirs, such as a process which died parked
+     * on a shared waitqueue.
+     */
+    void cancel_wait(int n = 1) {
+        __atomic_sub_fetch(&m_nWaiting, n, __ATOMIC_SEQ_CST);
+    }
+    /**
+     * wait for a notify() after ticket was taken, ends the wait started by
+     * prepare_wait().  false if until (0 for no limit) passed first.
+     */
+    bool wait(int ticket, const wait_policy& policy, const deadline* until) {
+        bool notified = park(ticket, policy, until);
+        cancel_wait();
+        return notified;
+    }
+    // wait() leaving the wait to be ended by cancel_wait()
+    bool park(int ticket, const wait_policy& policy, const deadline* until) {
+        bool notified = poll(ticket, policy);
+        while (!notified) {
+            if (until == 0) {
+                futex_wait(&m_seq, ticket, 0, m_shared);
+            }
+            else {
+                IceUtil::Time left = until->remaining();
+                if (left == IceUtil::Time() || !futex_wait(&m_seq, ticket, &left, m_shared)) {
+                    notified = changed(ticket);
+                    break;
+                }
+            }
+            notified = changed(ticket);
+        }
+        return notified;
+    }
+    /**
+     * false when nobody was waiting, the common case costs no syscall.
+     */
+    bool notify(size_t n) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (n == 0 || __atomic_load_n(&m_nWaiting, __ATOMIC_RELAXED) == 0) {
+            return false;
+        }
+        __atomic_add_fetch(&m_seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&m_seq, n < static_cast<size_t>(INT_MAX) ? static_cast<int>(n) : INT_MAX, m_shared);
+        return true;
+    }
+    bool notify_all(void) {
+        return notify(INT_MAX);
+    }
+    int waiting(void) const {
+        return __atomic_load_n(&m_nWaiting, __ATOMIC_RELAXED);
+    }
+
+  private:
+    bool changed(int ticket) const {
+        return __atomic_load_n(&m_seq, __ATOMIC_ACQUIRE) != ticket;
+    }
+    bool poll(int ticket, const wait_policy& policy) const {
+        for (unsigned i = 0; i < policy.spins; i++) {
+            if (changed(ticket)) {
+                return true;
+            }
+            XD_CPU_RELAX();
+        }
+        for (unsigned i = 0; i < policy.yields; i++) {
+            if (changed(ticket)) {
+                return true;
+            }
+            sched_yield();
+        }
+        return changed(ticket);
+    }
+
+  private:
+    // non-copyable
+    waitqueue(const waitqueue&);
+    waitqueue& operator=(const waitqueue&);
+
+  private:
+    int m_seq;
+    int m_nWaiting;
+    bool m_shared;
+};
+
+} // namespace util
+} // namespace xd
+
+#endif  // !__XD_UTIL_WAITQUEUE_H__
@@ -0,0 +1,174 @@
+/**
+ * binlog_decode
+ *  Turns the .blog files of a log made with binary_flag into the text its
+ *  text mode would have written, with the fraction in usecs whatever the
+ *  log's precision, see binlog.h.
+ *
+ *      binlog_decode [file]...
+ *
+ *  reads stdin without files and writes the lines to stdout.
+ */
+#include <stdint.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include <xd/util/binlog.h>
+#include <xd/util/strconv.h>
+
+namespace {
+
+// what the header record of the current file says
+struct header {
+    header(): separator(':'), pid(0) {
+    }
+    std::string app;
+    std::string time_format;
+    char separator;
+    uint32_t pid;
+};
+
+template <typename V>
+bool take(const std::string& record, size_t* pos, V* v) {
+    if (record.size() - *pos < sizeof(V)) {
+        return false;
+    }
+    memcpy(v, record.data() + *pos, sizeof(V));
+    *pos += sizeof(V);
+    return true;
+}
+
+bool take_cstr(const std::string& record, size_t* pos, std::string* s) {
+    size_t end = record.find('\0', *pos);
+    if (end == std::string::npos) {
+        return false;
+    }
+    s->assign(record, *pos, end - *pos);
+    *pos = end + 1;
+    return true;
+}
+
+class decoder {
+  public:
+    bool record(const std::string& record) {
+        size_t pos = 1;
+        switch (record[0]) {
+          case 'H':
+            m_formats.clear();
+            return take_cstr(record, &pos, &m_header.app) &&
+                take_cstr(record, &pos, &m_header.time_format) &&
+                take(record, &pos, &m_header.separator) &&
+                take(record, &pos, &m_header.pid);
+          case 'F': {
+            uint32_t id;
+            xd::util::binlog_formats::format f;
+            if (!take(record, &pos, &id) || !take_cstr(record, &pos, &f.level)) {
+                return false;
+            }
+            f.text.assign(record, pos, std::string::npos);
+            m_formats[id] = f;
+            return true;
+          }
+          case 'E':
+            return event(record);
+          case 'T':
+            fwrite(record.data() + 1, 1, record.size() - 1, stdout);
+            return true;
+          default:
+            return false;
+        }
+    }
+
+  private:
+    bool event(const std::string& record) {
+        size_t pos = 1;
+        uint32_t id;
+        int64_t usecs;
+        uint32_t tid;
+        if (!take(record, &pos, &id) || !take(record, &pos, &usecs) || !take(record, &pos, &tid)) {
+            return false;
+        }
+        std::map<uint32_t, xd::util::binlog_formats::format>::const_iterator f = m_formats.find(id);
+        if (f == m_formats.end()) {
+            return false;
+        }
+        char fraction[8];
+        snprintf(fraction, sizeof(fraction), ".%06u", static_cast<unsigned>(usecs % 1000000));
+        std::string line(xd::util::time2string(static_cast<time_t>(usecs / 1000000), m_header.time_format.c_str()));
+        line += fraction;
+        line += m_header.separator;
+        line += m_header.app;
+        line += m_header.separator;
+        line += xd::util::to_string(m_header.pid);
+        line += m_header.separator;
+        line += xd::util::to_string(tid);
+        line += m_header.separator;
+        line += f->second.level;
+        line += m_header.separator;
+        if (!xd::util::binlog_render(f->second.text, record.data() + pos, record.size() - pos, &line)) {
+            return false;
+        }
+        line += '\n';
+        fwrite(line.data(), 1, line.size(), stdout);
+        return true;
+    }
+
+  private:
+    header m_header;
+    std::map<uint32_t, xd::util::binlog_formats::format> m_formats;
+};
+
+bool decode(FILE* in, const char* name) {
+    decoder d;
+    std::string record;
+    for (long n = 0;; n++) {
+        uint32_t len;
+        size_t got = fread(&len, 1, sizeof(len), in);
+        if (got == 0 && feof(in)) {
+            return true;
+        }
+        if (got != sizeof(len)) {
+            fprintf(stderr, "%s: truncated record %ld\n", name, n);
+            return false;
+        }
+        if (len == 0 || len > xd::util::internal::BINLOG_MAX_RECORD) {
+            fprintf(stderr, "%s: bad record length %lu at record %ld\n", name,
+                    static_cast<unsigned long>(len), n);
+            return false;
+        }
+        record.resize(len);
+        if (fread(&record[0], 1, len, in) != len) {
+            fprintf(stderr, "%s: truncated record %ld\n", name, n);
+            return false;
+        }
+        if (!d.record(record)) {
+            fprintf(stderr, "%s: bad record %ld\n", name, n);
+            return false;
+        }
+    }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        return decode(stdin, "-") ? 0 : 1;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        FILE* in = fopen(argv[i], "rb");
+        if (in == 0) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (!decode(in, argv[i])) {
+            status = 1;
+        }
+        fclose(in);
+    }
+    return status;
+}